@@ -8,26 +8,146 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 // รวมไฟล์ header ที่กำหนดโครงสร้างและค่าคงที่ทั้งหมด
 #include "project_defs.h" 
+// ชั้น Transport (sysv / unix) ที่ใช้ร่วมกับ replay.c
+#include "client_transport.h"
 
 // --- GLOBAL STATE ---
-int control_qid = -1; // คิวควบคุมหลักของ Server (CONTROL_QUEUE_KEY)
-int reply_qid = -1;   // คิวส่วนตัวของ Client (IPC_PRIVATE)
 pid_t client_pid;    // PID ของไคลเอนต์เอง
 
+// --- LOGICAL SESSIONS (CHAT_SESSIONS=N: ทำงานแบบ Gateway หลายผู้ใช้บน Reply Queue เดียว) ---
+SessionId sessions[MAX_GATEWAY_SESSIONS];
+int session_count = 0;   // 0 = Client ปกติ (Session ID = PID)
+int current_session = 0; // Session ที่ใช้ส่งคำสั่งอยู่ในขณะนี้
+
+// --- LATENCY BREAKDOWN (CHAT_LATENCY=1: วัด Latency แยกตาม Stage จาก Stamp ใน ReplyMessage) ---
+// Histogram แบบ log2 ของไมโครวินาที: Bucket b เก็บค่า [2^(b-1), 2^b) us (Bucket 0 = < 1 us)
+#define LATENCY_BUCKETS 32
+
+typedef enum {
+    STAGE_CONTROL_QUEUE,  // client_send -> router_recv (รอใน Control Queue / Socket)
+    STAGE_ROUTER,         // router_recv -> job_enqueue (Handler, Rate Limit, Delay)
+    STAGE_JOB_QUEUE,      // job_enqueue -> dispatch (รอ Broadcaster)
+    STAGE_FANOUT,         // dispatch -> client_recv (Fan-out + Reply Queue)
+    STAGE_TOTAL,          // client_send -> client_recv
+    STAGE_COUNT
+} LatencyStage;
+
+static const char* stage_names[STAGE_COUNT] = { "ctrl-queue", "router", "job-queue", "fan-out", "total" };
+
+typedef struct {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    int64_t max_ns;
+} LatencyHistogram;
+
+int latency_enabled = 0;
+LatencyHistogram latency_hist[STAGE_COUNT];
+pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// --- TRANSPORT (Backend อยู่ใน client_transport.h) ---
+const ClientTransport* transport = NULL;
+
 // --- FORWARD DECLARATIONS ---
 void cleanup(int sig);
 void* sender_thread(void* arg);
 void* receiver_thread(void* arg);
 void send_command(CommandCode command, const char* channel, const char* target, const char* text);
+void send_command_list(CommandCode command, const char* channels, const char* text);
+void print_latency_report(void);
+
+// --- LATENCY HELPERS ---
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void latency_add(LatencyStage stage, int64_t ns) {
+    LatencyHistogram* h = &latency_hist[stage];
+    int b = 0;
+    if (ns < 0) ns = 0;
+    for (int64_t us = ns / 1000; us > 0 && b < LATENCY_BUCKETS - 1; us >>= 1) b++;
+    h->buckets[b]++;
+    h->count++;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+/**
+ * @brief บันทึก Latency ของแต่ละ Stage จาก Stamp ที่ Server ส่งกลับมา (ข้อความจาก Server เองไม่มี Stamp)
+ */
+static void latency_record(const ReplyMessage* reply, int64_t recv_ns) {
+    const LatencyStamps* st = &reply->stamps;
+    if (st->client_send_ns == 0 || st->router_recv_ns == 0 || st->dispatch_ns == 0) return;
+
+    pthread_mutex_lock(&latency_mutex);
+    latency_add(STAGE_CONTROL_QUEUE, st->router_recv_ns - st->client_send_ns);
+    latency_add(STAGE_ROUTER, st->job_enqueue_ns - st->router_recv_ns);
+    latency_add(STAGE_JOB_QUEUE, st->dispatch_ns - st->job_enqueue_ns);
+    latency_add(STAGE_FANOUT, recv_ns - st->dispatch_ns);
+    latency_add(STAGE_TOTAL, recv_ns - st->client_send_ns);
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+// ขอบบนของ Bucket ที่ถึง Percentile ที่ต้องการ (ไมโครวินาที, ไม่เกินค่า max ที่วัดได้จริง)
+static uint64_t latency_percentile(const LatencyHistogram* h, int pct) {
+    uint64_t rank = (h->count * pct + 99) / 100, seen = 0, max_us = (uint64_t)(h->max_ns / 1000);
+    int b = 0;
+    for (; b < LATENCY_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0) break;
+    }
+    return (1ULL << b) < max_us ? (1ULL << b) : max_us;
+}
+
+/**
+ * @brief พิมพ์สรุป Latency แยกตาม Stage (p50/p99 เป็นขอบบนของ Bucket) และ Histogram ของแต่ละ Stage
+ */
+void print_latency_report(void) {
+    if (!latency_enabled) return;
+
+    pthread_mutex_lock(&latency_mutex);
+    printf("\n--- Latency breakdown (%llu replies, us) ---\n", (unsigned long long)latency_hist[STAGE_TOTAL].count);
+    printf("%-10s %10s %10s %10s\n", "stage", "p50<=", "p99<=", "max");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const LatencyHistogram* h = &latency_hist[s];
+        if (h->count == 0) continue;
+        printf("%-10s %10llu %10llu %10lld\n", stage_names[s],
+               (unsigned long long)latency_percentile(h, 50), (unsigned long long)latency_percentile(h, 99),
+               (long long)(h->max_ns / 1000));
+    }
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const LatencyHistogram* h = &latency_hist[s];
+        if (h->count == 0) continue;
+        printf("[%s]\n", stage_names[s]);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (h->buckets[b] == 0) continue;
+            int bar = (int)(h->buckets[b] * 40 / h->count);
+            printf("  <%8llu us %8llu |%.*s\n", 1ULL << b, (unsigned long long)h->buckets[b],
+                   bar > 0 ? bar : 1, "########################################");
+        }
+    }
+    pthread_mutex_unlock(&latency_mutex);
+    fflush(stdout);
+}
 
 // --- THREAD 1: SENDER (Reads stdin and sends commands) ---
 void* sender_thread(void* arg) {
     char input_buffer[MAX_TEXT_SIZE + 100]; // Buffer for user input
     char cmd_str[20], param1[MAX_CHANNEL], text_content[MAX_TEXT_SIZE];
 
-    printf("Enter commands (e.g., JOIN #room, MSG <text>, DM <PID> <text>, WHO #room, QUIT):\n> ");
+    printf("Enter commands (e.g., JOIN #room, MSG <text>, NICK <name> [key], DM <PID|name> <text>, WHO #room, QUIT):\n");
+    printf("Topics: SUB #ops.* | SUB #ops.** | UNSUB <pattern> | PUB #ops.alerts.db <text>\n");
+    printf("Fan-out: MULTICAST #a,#b <text> | ANNOUNCE <text>\n");
+    if (latency_enabled) printf("Latency tracing on. Use STATS to print the per-stage breakdown.\n");
+    if (session_count > 0) {
+        printf("Gateway mode: %d sessions (%ld..%ld). Use USE <1-%d> to switch session.\n",
+               session_count, sessions[0], sessions[session_count - 1], session_count);
+    }
+    printf("> ");
 
     while (fgets(input_buffer, sizeof(input_buffer), stdin) != NULL) {
         // Clear previous values
@@ -48,15 +168,50 @@ void* sender_thread(void* arg) {
             send_command(CMD_JOIN, param1, "", "");
         } else if (strcmp(cmd_str, "MSG") == 0 && text_content[0] != '\0') {
             send_command(CMD_MSG, "", "", text_content);
+        } else if (strcmp(cmd_str, "NICK") == 0 && param1[0] != '\0') {
+            send_command(CMD_NICK, "", param1, text_content); // text = Key สำหรับตั้งชื่อที่ถูกจองไว้คืน
         } else if (strcmp(cmd_str, "DM") == 0 && param1[0] != '\0' && text_content[0] != '\0') {
-            // Note: In the server, target needs to be resolved from string/PID to reply_qid
+            // Target เป็น PID/Session ID หรือชื่อเล่น (Server ค้นหาจาก Nickname Directory)
             send_command(CMD_DM, "", param1, text_content);
         } else if (strcmp(cmd_str, "WHO") == 0 && param1[0] != '\0') {
             send_command(CMD_WHO, param1, "", "");
+        } else if ((strcmp(cmd_str, "SUB") == 0 || strcmp(cmd_str, "UNSUB") == 0) && param1[0] != '\0') {
+            send_command(cmd_str[0] == 'S' ? CMD_SUB : CMD_UNSUB, param1, "", "");
+        } else if (strcmp(cmd_str, "PUB") == 0 && param1[0] != '\0' && text_content[0] != '\0') {
+            send_command(CMD_PUB, param1, "", text_content);
+        } else if (strcmp(cmd_str, "MULTICAST") == 0 && param1[0] != '\0' && text_content[0] != '\0') {
+            // MULTICAST #a,#b <text>: sscanf ตัด param1 ที่ 31 ตัวอักษร จึงอ่านรายชื่อ Channel และข้อความจาก input เอง
+            char list[MAX_CHANNEL_LIST];
+            const char* start = strstr(input_buffer, cmd_str) + strlen(cmd_str);
+            start += strspn(start, " ");
+            size_t list_len = strcspn(start, " ");
+            if (list_len >= MAX_CHANNEL_LIST) {
+                printf("Channel list is too long (max %d characters). Nothing was sent.\n> ", MAX_CHANNEL_LIST - 1);
+            } else {
+                memcpy(list, start, list_len);
+                list[list_len] = '\0';
+                const char* body = start + list_len;
+                body += strspn(body, " ");
+                if (*body != '\0') send_command_list(CMD_MULTICAST, list, body);
+            }
+        } else if (strcmp(cmd_str, "ANNOUNCE") == 0 && param1[0] != '\0') {
+            // ข้อความทั้งหมดหลังคำสั่ง (sscanf แยกคำแรกไปไว้ใน param1)
+            const char* announce = strstr(input_buffer, cmd_str) + strlen(cmd_str);
+            send_command(CMD_ANNOUNCE, "", "", announce + strspn(announce, " "));
         } else if (strcmp(cmd_str, "LEAVE") == 0) {
             send_command(CMD_LEAVE, "", "", "");
+        } else if (strcmp(cmd_str, "USE") == 0 && session_count > 0 &&
+                   atoi(param1) >= 1 && atoi(param1) <= session_count) {
+            current_session = atoi(param1) - 1;
+            printf("Now acting as session %ld.\n", sessions[current_session]);
+        } else if (strcmp(cmd_str, "STATS") == 0 && latency_enabled) {
+            print_latency_report();
         } else if (strcmp(cmd_str, "QUIT") == 0) {
-            send_command(CMD_QUIT, "", "", "Goodbye");
+            // โหมด Gateway: ออกจากทุก Session
+            for (int i = 0; i < (session_count > 0 ? session_count : 1); i++) {
+                current_session = i;
+                send_command(CMD_QUIT, "", "", "Goodbye");
+            }
             kill(client_pid, SIGINT); // Trigger cleanup and exit via signal handler
             break;
         } else {
@@ -73,49 +228,90 @@ void* sender_thread(void* arg) {
 // --- THREAD 2: RECEIVER (Blocks on Reply Queue) ---
 void* receiver_thread(void* arg) {
     ReplyMessage reply;
+    int queue_requested = 0; // ความจุ Reply Queue ที่ขอตั้งไปแล้ว (ไม่ขอซ้ำหากถูกจำกัดด้วย msgmnb)
 
     while (1) {
-        // รอรับข้อความ mtype 2 (MSG_TYPE_BROADCAST) บน queue ส่วนตัว
-        if (msgrcv(reply_qid, &reply, sizeof(ReplyMessage) - sizeof(long), MSG_TYPE_BROADCAST, 0) == -1) {
-            if (errno == EIDRM) {
-                // Queue ถูกลบแล้ว (server หรือตัว client เองเป็นคนลบ)
+        int err = transport->recv_reply(&reply);
+        if (err == 0 && latency_enabled) latency_record(&reply, now_ns());
+        if (err != 0) {
+            if (err == EIDRM) {
+                // Queue ถูกลบแล้ว (server หรือตัว client เองเป็นคนลบ) หรือ Socket ถูกปิด
                 printf("\nServer disconnected or Private Queue removed. Exiting receiver thread...\n");
                 break;
             }
-            perror("msgrcv (client)");
+            if (err != EINTR) fprintf(stderr, "recv (client): %s\n", strerror(err));
             continue;
         }
 
+        // Welcome Message มีความจุ Reply Queue ที่ตกลงกันแล้ว (โหมด Gateway: ทุก Session ใช้ Queue เดียวกัน)
+        // Server เท่านั้นที่ตั้ง queue_capacity ได้ ไม่อ่านจากข้อความที่ผู้ใช้คนอื่นพิมพ์มา
+        int want = 0, got = 0;
+        if (reply.queue_capacity > 0 && transport->resize) {
+            want = reply.queue_capacity * (session_count > 0 ? session_count : 1);
+            if (want > queue_requested) {
+                queue_requested = want;
+                got = transport->resize(want);
+                if (got <= 0) perror("Failed to resize Reply Queue");
+            }
+        }
+
         // แสดงผลลัพธ์: \r (carriage return) ใช้สำหรับเคลียร์บรรทัดที่กำลังพิมพ์
-        printf("\r[%s] %s\n> ", reply.sender, reply.text);
+        if (session_count > 0) {
+            // โหมด Gateway: แยกข้อความตาม Session ด้วย mtype
+            printf("\r<%ld> [%s] %s\n> ", reply.mtype, reply.sender, reply.text);
+        } else {
+            printf("\r[%s] %s\n> ", reply.sender, reply.text);
+        }
+        // ความจุที่ตั้งได้จริง (msg_qbytes / ขนาด Frame) อาจน้อยกว่าที่ Server เสนอเมื่อไม่มีสิทธิ์เกิน kernel.msgmnb
+        if (got > 0 && got < want) {
+            printf("\r[CLIENT] Reply queue set to %d msgs (asked for %d; above kernel.msgmnb needs CAP_SYS_RESOURCE)\n> ",
+                   got, want);
+        } else if (got > 0) {
+            printf("\r[CLIENT] Reply queue set to %d msgs\n> ", got);
+        }
         fflush(stdout); // แสดงผลทันที
     }
     
     return NULL;
 }
 
-// --- IPC HELPER (ส่งคำสั่งไปยัง Server Control Queue) ---
-void send_command(CommandCode command, const char* channel, const char* target, const char* text) {
+// --- IPC HELPER (ส่งคำสั่งไปยัง Server ผ่าน Transport) ---
+static void send_command_full(CommandCode command, const char* channel, const char* target,
+                              const char* channels, const char* text) {
     CommandMessage cmd;
     cmd.mtype = MSG_TYPE_COMMAND;
     cmd.command = command;
     cmd.sender_pid = client_pid;
     cmd.reply_qid = reply_qid; // **ส่ง ID คิวส่วนตัวไปให้ Server**
+    cmd.session_id = session_count > 0 ? sessions[current_session] : 0;
+    memset(&cmd.stamps, 0, sizeof(cmd.stamps));
+    cmd.stamps.client_send_ns = now_ns();
     strncpy(cmd.channel, channel, MAX_CHANNEL);
     strncpy(cmd.target, target, MAX_USERNAME);
+    memset(cmd.channels, 0, sizeof(cmd.channels));
+    strncpy(cmd.channels, channels, MAX_CHANNEL_LIST - 1);
     strncpy(cmd.text, text, MAX_TEXT_SIZE);
 
-    // msgsnd sends non-blocking, we assume the server's control queue is large enough
-    if (msgsnd(control_qid, &cmd, sizeof(CommandMessage) - sizeof(long), 0) == -1) {
-        if (errno == EIDRM) {
+    int err = transport->send_command(&cmd);
+    if (err != 0) {
+        if (err == EIDRM) {
             fprintf(stderr, "\nERROR: Server Control Queue was removed. Exiting...\n");
             cleanup(0);
         } else {
-            perror("msgsnd to Control Queue failed");
+            fprintf(stderr, "send to Control Queue failed: %s\n", strerror(err));
         }
     }
 }
 
+void send_command(CommandCode command, const char* channel, const char* target, const char* text) {
+    send_command_full(command, channel, target, "", text);
+}
+
+// คำสั่งที่มีรายชื่อ Channel (MULTICAST): รายชื่ออยู่ใน CommandMessage.channels
+void send_command_list(CommandCode command, const char* channels, const char* text) {
+    send_command_full(command, "", "", channels, text);
+}
+
 // --- CLEANUP FUNCTION (Ctrl+C, QUIT, หรือ SIGTERM) ---
 void cleanup(int sig) {
     if (sig == SIGTERM) {
@@ -126,12 +322,10 @@ void cleanup(int sig) {
         printf("\nClient shutting down normally. Removing client queue...\n");
     }
 
-    // Remove the private Reply Queue (ป้องกันการค้าง)
-    if (reply_qid != -1 && msgctl(reply_qid, IPC_RMID, NULL) == 0) {
-        printf("Private Reply Queue removed successfully.\n");
-    } else if (reply_qid != -1 && errno != EIDRM) {
-        perror("Failed to remove private Reply Queue");
-    }
+    print_latency_report();
+
+    // ลบคิวส่วนตัว / ปิด Socket ตาม Transport ที่ใช้อยู่
+    if (transport) transport->close();
     
     exit(EXIT_SUCCESS);
 }
@@ -145,24 +339,38 @@ int main() {
     signal(SIGINT, cleanup); 
     signal(SIGTERM, cleanup); 
 
-    // 1. เชื่อมต่อ Queue ของ Server (Control Queue)
-    control_qid = msgget(CONTROL_QUEUE_KEY, 0666);
-    if (control_qid == -1) {
-        perror("Failed to get Control Queue. Is server running?");
-        exit(EXIT_FAILURE);
-    }
-    
-    // 2. สร้าง Queue ส่วนตัว (Reply Queue) ใช้ IPC_PRIVATE เพื่อให้มี ID เฉพาะตัว
-    reply_qid = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if (reply_qid == -1) {
-        perror("Failed to create private Reply Queue");
+    // 1-2. เชื่อมต่อ Server และเตรียมช่องทางรับข้อความตาม Transport ที่เลือก
+    transport = transport_from_env();
+    transport_verbose = 1;
+    transport_recv_mtype = -MSG_TYPE_BROADCAST; // ปกติอ่านข้อความด่วนก่อน, โหมด Gateway อ่านทุก Session (0)
+    if (transport->connect() == -1) {
+        transport->close();
         exit(EXIT_FAILURE);
     }
 
-    printf("Client started (PID: %d). Private Reply Queue ID: %d\n", client_pid, reply_qid);
+    const char* lat = getenv("CHAT_LATENCY");
+    latency_enabled = lat && atoi(lat) != 0;
+
+    // ความจุ Reply Queue ที่ขอ (จำนวนข้อความต่อ Session, ว่าง = ใช้ค่าที่ Server แนะนำ)
+    const char* want_capacity = getenv("CHAT_REPLY_QUEUE_REQUEST_MSGS");
+    if (want_capacity == NULL) want_capacity = "";
 
-    // 3. ส่งข้อความ REGISTER ไปยัง Server ทันที
-    send_command(CMD_REGISTER, "", "", "New client connection");
+    // 3. ส่งข้อความ REGISTER ไปยัง Server ทันที (โหมด Gateway: 1 ครั้งต่อ Session, ใช้ Reply Queue เดียวกัน)
+    const char* ns = getenv("CHAT_SESSIONS");
+    session_count = ns ? atoi(ns) : 0;
+    if (session_count < 0) session_count = 0;
+    if (session_count > MAX_GATEWAY_SESSIONS) session_count = MAX_GATEWAY_SESSIONS;
+    if (session_count > 0) {
+        transport_recv_mtype = 0;
+        for (int i = 0; i < session_count; i++) {
+            sessions[i] = MAKE_SESSION_ID(client_pid, i + 1);
+            current_session = i;
+            send_command(CMD_REGISTER, "", want_capacity, "New gateway session");
+        }
+        current_session = 0;
+    } else {
+        send_command(CMD_REGISTER, "", want_capacity, "New client connection");
+    }
 
     // 4. สร้าง 2 เธรด
     if (pthread_create(&receiver_tid, NULL, receiver_thread, NULL) != 0) {
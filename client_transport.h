@@ -0,0 +1,149 @@
+#ifndef CLIENT_TRANSPORT_H
+#define CLIENT_TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/msg.h>
+#include <sys/ipc.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "project_defs.h"
+#include "sysv_capacity.h"
+
+/*
+ * ชั้น Transport ฝั่ง Client (เลือกด้วย CHAT_TRANSPORT ให้ตรงกับ Server)
+ * ใช้ร่วมกันโดย client.c และ replay.c แต่ละโปรแกรม include ไฟล์นี้เพียงครั้งเดียว จึงประกาศ State ไว้ที่นี่
+ */
+
+// --- TRANSPORT STATE ---
+int control_qid = -1;            // คิวควบคุมหลักของ Server (CONTROL_QUEUE_KEY)
+int reply_qid = -1;              // คิวส่วนตัวของ Client (IPC_PRIVATE)
+int sock_fd = -1;                // Socket ไปยัง Server (เฉพาะ CHAT_TRANSPORT=unix)
+long transport_recv_mtype = 0;   // mtype ที่ sysv_recv_reply อ่าน (0 = ทุกข้อความ, ติดลบ = ข้อความด่วนก่อน)
+int transport_verbose = 0;       // พิมพ์สถานะการเชื่อมต่อ/ปิด (client.c เปิด, replay.c ปิด)
+
+typedef struct {
+    const char* name;
+    int  (*connect)(void);                            // คืนค่า -1 หากล้มเหลว
+    int  (*send_command)(const CommandMessage* cmd);  // คืนค่า 0 หรือ errno
+    int  (*recv_reply)(ReplyMessage* reply);          // บล็อก, คืนค่า 0, errno หรือ EIDRM เมื่อ Server หลุด
+    int  (*resize)(int msgs);                         // ตั้งความจุช่องทางรับข้อความ, คืนค่าความจุจริง (NULL = ไม่รองรับ)
+    void (*close)(void);
+} ClientTransport;
+
+// --- Transport Backend: System V Message Queues ---
+
+static int sysv_connect(void) {
+    // 1. เชื่อมต่อ Queue ของ Server (Control Queue)
+    control_qid = msgget(CONTROL_QUEUE_KEY, 0666);
+    if (control_qid == -1) {
+        perror("Failed to get Control Queue. Is server running?");
+        return -1;
+    }
+
+    // 2. สร้าง Queue ส่วนตัว (Reply Queue) ใช้ IPC_PRIVATE เพื่อให้มี ID เฉพาะตัว
+    reply_qid = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
+    if (reply_qid == -1) {
+        perror("Failed to create private Reply Queue");
+        return -1;
+    }
+
+    if (transport_verbose) printf("Client started (PID: %d). Private Reply Queue ID: %d\n", getpid(), reply_qid);
+    return 0;
+}
+
+static int sysv_send_command(const CommandMessage* cmd) {
+    // msgsnd sends non-blocking, we assume the server's control queue is large enough
+    if (msgsnd(control_qid, cmd, sizeof(CommandMessage) - sizeof(long), 0) == -1) return errno;
+    return 0;
+}
+
+static int sysv_recv_reply(ReplyMessage* reply) {
+    // รอรับข้อความบน queue ส่วนตัว: mtype ติดลบให้ได้ MSG_TYPE_REPLY (ด่วน) ก่อน MSG_TYPE_BROADCAST
+    // โหมด Gateway / replay: mtype คือ Session ID จึงอ่านทุกข้อความ (0) แล้วแยกตาม mtype เอง
+    if (msgrcv(reply_qid, reply, sizeof(ReplyMessage) - sizeof(long), transport_recv_mtype, 0) == -1) return errno;
+    return 0;
+}
+
+static int sysv_resize(int msgs) {
+    // ตั้ง msg_qbytes ของ Reply Queue ตามค่าที่ตกลงกับ Server (เกิน kernel.msgmnb ต้องมีสิทธิ์ CAP_SYS_RESOURCE)
+    return sysv_set_capacity(reply_qid, msgs, sizeof(ReplyMessage) - sizeof(long));
+}
+
+static void sysv_close(void) {
+    // Remove the private Reply Queue (ป้องกันการค้าง)
+    if (reply_qid != -1 && msgctl(reply_qid, IPC_RMID, NULL) == 0) {
+        if (transport_verbose) printf("Private Reply Queue removed successfully.\n");
+    } else if (reply_qid != -1 && errno != EIDRM && transport_verbose) {
+        perror("Failed to remove private Reply Queue");
+    }
+}
+
+static const ClientTransport sysv_transport = {
+    "sysv", sysv_connect, sysv_send_command, sysv_recv_reply, sysv_resize, sysv_close
+};
+
+// --- Transport Backend: Unix Domain Socket (SOCK_SEQPACKET) ---
+// 1 Connection ใช้ทั้งส่งคำสั่งและรับข้อความตอบกลับ (Server กำหนด Endpoint ให้เอง)
+// หมายเหตุ: Socket ส่งตามลำดับ FIFO จึงไม่มีการอ่านข้อความด่วนก่อนแบบ msgrcv ติดลบ
+
+static int sock_connect(void) {
+    const char* path = getenv("CHAT_SOCKET_PATH");
+    struct sockaddr_un addr;
+
+    sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock_fd == -1) {
+        perror("socket (client)");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", (path && *path) ? path : DEFAULT_SOCKET_PATH);
+    if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("Failed to connect to server socket. Is server running?");
+        return -1;
+    }
+
+    if (transport_verbose) printf("Client started (PID: %d). Connected to %s\n", getpid(), addr.sun_path);
+    return 0;
+}
+
+static int sock_send_command(const CommandMessage* cmd) {
+    if (send(sock_fd, cmd, sizeof(CommandMessage), MSG_NOSIGNAL) == -1) {
+        return errno == EPIPE ? EIDRM : errno;
+    }
+    return 0;
+}
+
+static int sock_recv_reply(ReplyMessage* reply) {
+    ssize_t n = recv(sock_fd, reply, sizeof(ReplyMessage), 0);
+    if (n == 0) return EIDRM; // Server ปิด Connection
+    if (n == -1) return errno == EBADF ? EIDRM : errno;
+    return 0;
+}
+
+static void sock_close(void) {
+    if (sock_fd != -1) {
+        shutdown(sock_fd, SHUT_RDWR); // ปลุก receiver thread ที่บล็อกอยู่
+        close(sock_fd);
+        if (transport_verbose) printf("Server connection closed.\n");
+    }
+}
+
+static const ClientTransport sock_transport = {
+    "unix", sock_connect, sock_send_command, sock_recv_reply, NULL, sock_close
+};
+
+/**
+ * @brief เลือก Backend ตาม CHAT_TRANSPORT (ค่าเริ่มต้น DEFAULT_TRANSPORT) ให้ตรงกับ Server
+ */
+static const ClientTransport* transport_from_env(void) {
+    const char* tp = getenv("CHAT_TRANSPORT");
+    return strcmp((tp && *tp) ? tp : DEFAULT_TRANSPORT, "unix") == 0 ? &sock_transport : &sysv_transport;
+}
+
+#endif // CLIENT_TRANSPORT_H
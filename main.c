@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // สำหรับ sendmmsg, accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,174 +10,1029 @@
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <ctype.h>
+#include <sys/random.h>
 
 #include "project_defs.h"
+#include "sysv_capacity.h"
+#include "registry_seqlock.h"
 
 // --- Global State and Synchronization for Job Queue ---
 pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
-Job* job_queue_head = NULL;
-Job* job_queue_tail = NULL;
+pthread_cond_t job_cond;   // ใช้ CLOCK_MONOTONIC (ตั้งค่าใน init_server_state)
+// หนึ่งคิว (FIFO) ต่อหนึ่ง Priority Class
+Job* job_queue_head[JOB_PRIO_COUNT] = { NULL };
+Job* job_queue_tail[JOB_PRIO_COUNT] = { NULL };
+int interactive_streak = 0; // จำนวนงาน Interactive ที่ทำติดกัน (กัน Bulk อดตาย)
+
+// --- Adaptive Broadcaster Pool State (ป้องกันด้วย job_mutex) ---
+int pool_size = 0;          // จำนวน Worker ที่มีชีวิตอยู่ (รวมตัวที่กำลังถูกสร้าง)
+int pool_idle = 0;          // จำนวน Worker ที่กำลังรองานอยู่
+int pool_peak = 0;          // ขนาด Pool สูงสุดตั้งแต่รายงานครั้งก่อน
+int job_depth = 0;          // จำนวนงานที่ค้างในทุก Priority Class
+
+// --- Pool Telemetry (อ่านโดย Monitor Thread) ---
+_Atomic int64_t pool_busy_ns = 0;         // เวลารวมที่ Worker ใช้ทำงาน
+_Atomic uint64_t jobs_dispatched = 0;
+_Atomic int64_t dispatch_latency_ns = 0;  // ผลรวมเวลาตั้งแต่ add_job ถึงตอนถูกดึงไปทำ
 
 // --- Global Registry State ---
 GlobalRegistry registry;
 int control_qid = -1; // Server's control message queue ID
+int nick_table[NICK_TABLE_SIZE]; // Nickname Directory: Client Slot + 1 (0 = Bucket ว่าง), แก้ไขภายใต้ WRITE Lock
+
+// --- Server Configuration & Admission Control State ---
+ServerConfig config;
+RateLimitSlot rate_limits[MAX_CLIENTS]; // แยกจาก ClientEntry เพื่อให้ Router อ่าน/เขียนได้โดยไม่ต้องถือ rwlock
+
+// --- Client Health State (Dead / Slow Consumer Detection) ---
+typedef struct {
+    _Atomic int dead;       // ตั้งโดย Broadcaster เมื่อเจอ EIDRM ครั้งแรก
+} ClientHealth;
+
+ClientHealth client_health[MAX_CLIENTS];
+pthread_mutex_t health_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t health_cond;         // ใช้ CLOCK_MONOTONIC (ตั้งค่าใน init_server_state)
+int health_wakeup = 0;              // มี Client ถูกทำเครื่องหมายว่าตาย ให้ Sweep ทันที
+_Atomic uint64_t evicted_dead = 0, evicted_slow = 0;
+
+// --- Kernel Queue Capacity State (Backend sysv) ---
+_Atomic int ctrl_queue_capacity = 0;  // ความจุปัจจุบันของ Control Queue (ข้อความ, 0 = ไม่ได้ใช้ sysv)
+_Atomic int ctrl_queue_peak_pct = 0;  // Occupancy สูงสุดที่สุ่มวัดได้ตั้งแต่รายงานครั้งก่อน
+_Atomic uint64_t reply_drops = 0;     // จำนวนข้อความที่ถูกทิ้งเพราะปลายทางเต็ม (EAGAIN)
+
+// --- Shutdown State ---
+_Atomic int server_stopping = 0;      // ตั้งครั้งเดียวเมื่อเริ่มปิด Server (Router ใช้ตรวจว่าควรจบ)
+pthread_t router_tid;
+int router_running = 0;               // Router Thread ถูกสร้างแล้วและยังไม่ถูก join
+
+// --- Topic Subscription State (ป้องกันด้วย registry.rwlock, ยกเว้น Cache) ---
+typedef struct {
+    char topic[MAX_CHANNEL];
+    uint64_t mask;          // Slot ของผู้รับที่ Match
+    unsigned generation;    // ตรงกับ topic_generation = ยังใช้ได้
+} TopicCacheEntry;
+
+TopicNode topic_root;                       // Root (ไม่มี Segment)
+int topic_node_count = 0;
+int topic_sub_count[MAX_CLIENTS];           // จำนวน Pattern ของแต่ละ Slot
+unsigned topic_generation = 1;              // เพิ่มทุกครั้งที่ Subscription เปลี่ยน (Cache เก่าหมดอายุ)
+TopicCacheEntry topic_cache[TOPIC_CACHE_SIZE];
+pthread_mutex_t topic_cache_mutex = PTHREAD_MUTEX_INITIALIZER; // PUB หลายตัวเติม Cache พร้อมกันภายใต้ READ Lock
+_Atomic uint64_t topic_cache_hits = 0, topic_cache_misses = 0;
+
+// --- Offline Mailbox State ---
+int mailbox_enabled = 0;
+int mailbox_fd = -1;
+unsigned char* mailbox_map = NULL;  // mmap ของไฟล์ทั้งไฟล์ (ย้ายได้เมื่อ mremap)
+size_t mailbox_size = 0;
+uint64_t mailbox_dead = 0;          // ไบต์ของจดหมายที่ส่งแล้ว (คืนพื้นที่ตอน Compact)
+MailIndexEntry mailbox_index[MAILBOX_INDEX_SIZE];
+pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER; // ป้องกันไฟล์ + Index
+int mailbox_inflight = 0;           // จดหมายสถานะ MAIL_SENDING (รอ Broadcaster แจ้งผล)
+pthread_cond_t mailbox_sent_cond = PTHREAD_COND_INITIALIZER; // ส่งสัญญาณเมื่อ mailbox_inflight กลับเป็น 0
+
+// คำขอ Flush จาก handle_nick (แยก Lock จากไฟล์ เพื่อไม่ให้การตั้งชื่อรอ Compaction)
+typedef struct MailFlushRequest {
+    char nick[NICK_MAX_LEN + 1];
+    struct MailFlushRequest* next;
+} MailFlushRequest;
+
+MailFlushRequest* mailbox_req_head = NULL;
+MailFlushRequest* mailbox_req_tail = NULL;
+pthread_mutex_t mailbox_req_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mailbox_cond;        // ใช้ CLOCK_MONOTONIC (ตั้งค่าใน init_server_state)
+int mailbox_stop = 0;               // ตั้งโดย mailbox_close (ป้องกันด้วย mailbox_req_mutex)
+int mailbox_running = 0;            // Mailbox Thread ถูกสร้างแล้ว (ต้อง join ก่อนปิดไฟล์)
+pthread_t mailbox_tid;
+
+// --- Traffic Capture State (Double Buffer: Router เติม, Capture Thread เขียนลงไฟล์) ---
+FILE* capture_file = NULL;
+pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t capture_cond;        // ใช้ CLOCK_MONOTONIC (ตั้งค่าใน init_server_state)
+char capture_buf[2][CAPTURE_BUFFER_SIZE];
+size_t capture_len[2] = { 0, 0 };
+int capture_active = 0;             // Buffer ที่ Router กำลังเติม
+int capture_pending = -1;           // Buffer ที่เต็มแล้วรอเขียนลงไฟล์ (-1 = ไม่มี)
+int capture_stop = 0;               // ตั้งโดย capture_close: Writer เขียนที่ค้างทั้งหมดแล้วจบ
+pthread_t capture_tid;
+int64_t capture_start_ns = 0;
+uint64_t capture_records = 0, capture_dropped = 0;
+
+// --- Presence Coalescing State (Join/Leave ต่อห้อง) ---
+typedef struct {
+    char channel[MAX_CHANNEL];          // "" = Slot ว่าง
+    int joined, left;
+    char joined_sample[PRESENCE_SAMPLE][MAX_USERNAME]; // ชื่อที่แสดง (label) ตัวอย่างใน Digest ณ เวลาที่เกิด Event
+    char left_sample[PRESENCE_SAMPLE][MAX_USERNAME];
+    int64_t first_ns;                   // เวลาของ Event แรกในรอบนี้
+} PresenceBuffer;
+
+pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t presence_cond;       // ใช้ CLOCK_MONOTONIC (ตั้งค่าใน init_server_state)
+PresenceBuffer presence[MAX_CHANNELS];
+
+// --- Delayed Command Queue (โหมด THROTTLE_DELAY) ---
+typedef struct DelayedCommand {
+    int64_t ready_ns;
+    CommandMessage cmd;
+    struct DelayedCommand* next;
+} DelayedCommand;
+
+pthread_mutex_t delay_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t delay_cond;  // ใช้ CLOCK_MONOTONIC (ตั้งค่าใน init_server_state)
+DelayedCommand* delay_queue_head = NULL; // เรียงตาม ready_ns
 
 // --- Forward Declarations & Helpers ---
-void cleanup(int sig);
+void cleanup();
+int pool_spawn_worker();
 void init_server_state();
 void router_thread();
 void* broadcaster_thread(void* arg);
 void* monitor_clients(void* arg);
 void add_job(Job* new_job);
 Job* get_job();
-void remove_client(pid_t pid);
+void remove_client(SessionId session);
+void topic_remove_slot(int slot);
 
-int find_client_index(pid_t pid);
+int find_client_index(SessionId session);
 int find_room_index(const char* channel_name);
-void add_client_to_room(int room_idx, pid_t pid);
-void remove_client_from_room(int room_idx, pid_t pid);
-void send_reply(int target_qid, const char* sender, const char* text);
+void add_client_to_room(int room_idx, SessionId session);
+void remove_client_from_room(int room_idx, SessionId session);
+int send_reply(int target_qid, long mtype, const char* sender, const char* text, const LatencyStamps* stamps);
+int send_frame(int target_qid, const ReplyMessage* reply);
+void health_mark_dead(int client_idx);
+void health_mark_dead_qid(int reply_qid);
+static int room_targets(const char* channel, JobTarget targets[MAX_CLIENTS]);
+void dispatch_command(const CommandMessage* cmd);
+static _Thread_local const LatencyStamps* dispatch_stamps = NULL; // Stamp ของคำสั่งที่ Handler กำลังทำงาน
+void* delay_thread(void* arg);
+void* presence_thread(void* arg);
+void* health_thread(void* arg);
+void* capture_thread(void* arg);
+void capture_command(const CommandMessage* cmd);
+void* mailbox_thread(void* arg);
+int mailbox_store(const char* recipient, const char* sender, const char* text);
+int mailbox_seen(const char* nick);
+int mailbox_claim(const char* nick, const char* key_text, SessionId session, uint64_t* key_out);
+int mailbox_nick_of(SessionId session, char nick[NICK_MAX_LEN + 1]);
+void mailbox_sent(uint64_t offset, int ok);
+void mailbox_request_flush(const char* nick);
+void presence_event(const char* channel, const char* label, int joined);
 
 
 // --- Broadcaster Job Queue Functions ---
 
+/**
+ * @brief เวลาปัจจุบันแบบ Monotonic (นาโนวินาที)
+ */
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief ตัดสินใจว่าควรขยาย Broadcaster Pool หรือไม่ (ต้องเรียกภายใต้ job_mutex)
+ * @details ขยายเมื่อไม่มี Worker ว่างเลย และงานค้างเกิน pool_grow_depth หรืองานรอนานเกิน pool_grow_latency_ms
+ * ขนาด Pool ถูกนับเพิ่มทันทีเพื่อกันการสร้างซ้ำ ผู้เรียกต้องเรียก pool_spawn_worker() หลังปลด Lock
+ * @return 1 หากผู้เรียกต้องสร้าง Worker ใหม่
+ */
+static int pool_should_grow(int64_t latency_ns) {
+    if (pool_idle > 0 || pool_size >= config.pool_max) return 0;
+    if (job_depth <= config.pool_grow_depth &&
+        latency_ns <= (int64_t)config.pool_grow_latency_ms * 1000000) return 0;
+
+    pool_size++;
+    if (pool_size > pool_peak) pool_peak = pool_size;
+    return 1;
+}
+
+/**
+ * @brief จัด Priority Class ให้กับงานตามประเภท
+ * @details งาน Fan-out (CMD_MSG, CMD_PUB, CMD_MULTICAST, CMD_ANNOUNCE) เป็นงาน Bulk ส่วนงานตอบกลับรายคนทั้งหมดเป็น Interactive
+ */
+static JobPriority job_priority(const Job* job) {
+    switch (job->type) {
+        case CMD_MSG:
+        case CMD_PUB:
+        case CMD_MULTICAST:
+        case CMD_ANNOUNCE:
+            return JOB_PRIO_BULK;
+        default:
+            return JOB_PRIO_INTERACTIVE;
+    }
+}
+
 /**
  * @brief เพิ่มงานเข้าสู่ Broadcaster Job Queue (ป้องกันด้วย Mutex)
+ * @details งานจะถูกใส่ในคิวตาม Priority Class ของตัวเอง
  * @param new_job โครงสร้างงานที่ต้องการเพิ่ม
  */
 void add_job(Job* new_job) {
+    JobPriority prio = job_priority(new_job);
+    int grow;
+
+    // Job ที่เกิดจากคำสั่งของ Client รับ Stamp ต่อจากคำสั่งนั้น (งานของ Presence Thread ฯลฯ เป็น 0)
+    if (dispatch_stamps) {
+        new_job->stamps = *dispatch_stamps;
+    } else {
+        memset(&new_job->stamps, 0, sizeof(new_job->stamps));
+    }
+    new_job->stamps.job_enqueue_ns = now_ns();
     pthread_mutex_lock(&job_mutex);
+    new_job->priority = prio;
     new_job->next = NULL;
-    if (job_queue_tail) {
-        job_queue_tail->next = new_job;
+    if (job_queue_tail[prio]) {
+        job_queue_tail[prio]->next = new_job;
     } else {
-        job_queue_head = new_job;
+        job_queue_head[prio] = new_job;
     }
-    job_queue_tail = new_job;
+    job_queue_tail[prio] = new_job;
+    job_depth++;
+    grow = pool_should_grow(0);
     pthread_cond_signal(&job_cond); // ส่งสัญญาณปลุก broadcaster ที่กำลังรอ
     pthread_mutex_unlock(&job_mutex);
+
+    if (grow) pool_spawn_worker();
+}
+
+/**
+ * @brief เลือก Priority Class ที่จะดึงงานถัดไป (ต้องเรียกภายใต้ job_mutex)
+ * @details ทำงาน Interactive ก่อนเสมอ ยกเว้นทำติดกันครบ BULK_STARVATION_LIMIT งาน
+ * และมีงาน Bulk รออยู่ จึงให้ Bulk ได้ทำ 1 งาน
+ * @return Priority Class ที่มีงาน หรือ -1 หากทุกคิวว่าง
+ */
+static int pick_job_class() {
+    if (job_queue_head[JOB_PRIO_INTERACTIVE] != NULL &&
+        (interactive_streak < BULK_STARVATION_LIMIT || job_queue_head[JOB_PRIO_BULK] == NULL)) {
+        interactive_streak++;
+        return JOB_PRIO_INTERACTIVE;
+    }
+    for (int p = JOB_PRIO_BULK; p < JOB_PRIO_COUNT; p++) {
+        if (job_queue_head[p] != NULL) {
+            interactive_streak = 0;
+            return p;
+        }
+    }
+    return -1;
 }
 
 /**
  * @brief ดึงงานจาก Broadcaster Job Queue (ป้องกันด้วย Mutex)
- * @return งานถัดไปในคิว, หรือจะถูกบล็อกหากคิวว่าง
+ * @details Worker ที่ว่างนานเกิน pool_idle_ms จะถูกปลดออก ตราบใดที่ Pool ยังใหญ่กว่า pool_min
+ * @return งานถัดไปตาม Priority, หรือ NULL หาก Worker ตัวนี้ควรจบการทำงาน
  */
 Job* get_job() {
     Job* job = NULL;
+    int prio, grow;
+    int timed_out = 0;
     pthread_mutex_lock(&job_mutex);
     
-    // รอจนกว่าจะมีงานเข้ามาในคิว
-    while (job_queue_head == NULL) {
-        pthread_cond_wait(&job_cond, &job_mutex);
+    // รอจนกว่าจะมีงานเข้ามาในคิวใดคิวหนึ่ง
+    while ((prio = pick_job_class()) == -1) {
+        if (timed_out && pool_size > config.pool_min) {
+            pool_size--; // Cooldown ครบแล้ว: ปลด Worker ตัวนี้
+            pthread_mutex_unlock(&job_mutex);
+            return NULL;
+        }
+
+        int64_t deadline = now_ns() + (int64_t)config.pool_idle_ms * 1000000;
+        struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+        pool_idle++;
+        timed_out = pthread_cond_timedwait(&job_cond, &job_mutex, &ts) == ETIMEDOUT;
+        pool_idle--;
     }
 
-    job = job_queue_head;
-    job_queue_head = job->next;
-    if (job_queue_head == NULL) {
-        job_queue_tail = NULL;
+    job = job_queue_head[prio];
+    job_queue_head[prio] = job->next;
+    if (job_queue_head[prio] == NULL) {
+        job_queue_tail[prio] = NULL;
     }
     job->next = NULL; // ปลด Job ออกจากรายการ
+    job_depth--;
 
+    job->stamps.dispatch_ns = now_ns();
+    int64_t latency = job->stamps.dispatch_ns - job->stamps.job_enqueue_ns;
+    grow = pool_should_grow(latency);
     pthread_mutex_unlock(&job_mutex);
+
+    atomic_fetch_add_explicit(&jobs_dispatched, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&dispatch_latency_ns, latency, memory_order_relaxed);
+    if (grow) pool_spawn_worker();
     return job;
 }
 
+// สถานะของปลายทางตอบกลับ (ใช้ตรวจ Slow Consumer)
+typedef struct {
+    int backlog;            // จำนวนข้อความที่ค้างอยู่ฝั่ง Client
+    int64_t idle_ms;        // เวลาตั้งแต่ Client อ่านข้อความครั้งล่าสุด
+} EndpointStats;
+
+// --- Transport Layer (เลือก Backend ตอนเริ่ม Server ด้วย CHAT_TRANSPORT) ---
+// ทุก Backend ใช้ "Endpoint ID" แบบ int แทนปลายทางตอบกลับ ซึ่งถูกเก็บไว้ใน reply_qid ของ Registry/Job
+// - sysv: Endpoint = reply_qid ของ Client (IPC_PRIVATE queue)
+// - unix: Endpoint = (generation << 16) | slot ของ Connection ฝั่ง Server
+
+typedef struct {
+    const char* name;
+    int  (*init)(void);                              // สร้าง Control Endpoint, คืนค่า -1 หากล้มเหลว
+    int  (*recv_command)(CommandMessage* cmd);       // บล็อกจนได้คำสั่ง, คืนค่า -1 เมื่อ Server กำลังปิดตัว
+    int  (*send_reply)(int endpoint, const ReplyMessage* reply); // ไม่บล็อก, คืนค่า 0 หรือ errno
+    int  (*probe)(int endpoint, EndpointStats* st);  // ตรวจสถานะปลายทาง, คืนค่า 0 หรือ errno (EIDRM = ตายแล้ว)
+    void (*shutdown)(void);
+} ServerTransport;
+
+const ServerTransport* transport = NULL;
+
+// --- Transport Backend: System V Message Queues ---
+
+/**
+ * @brief สุ่มวัด Occupancy ของ Control Queue และขยายความจุเป็น 2 เท่าเมื่อใช้เกิน CTRL_QUEUE_HIGH_WATER
+ * @details เรียกจาก Router ทุกๆ CTRL_QUEUE_SAMPLE คำสั่ง (IPC_STAT 1 ครั้ง) ไม่เกิน ctrl_queue_max_msgs
+ */
+static void sysv_control_adapt(void) {
+    struct msqid_ds ds;
+    if (msgctl(control_qid, IPC_STAT, &ds) == -1 || ds.msg_qbytes == 0) return;
+
+    int pct = (int)(ds.__msg_cbytes * 100 / ds.msg_qbytes);
+    if (pct > atomic_load_explicit(&ctrl_queue_peak_pct, memory_order_relaxed)) {
+        atomic_store_explicit(&ctrl_queue_peak_pct, pct, memory_order_relaxed);
+    }
+
+    int capacity = atomic_load_explicit(&ctrl_queue_capacity, memory_order_relaxed);
+    if (pct < CTRL_QUEUE_HIGH_WATER || capacity >= config.ctrl_queue_max_msgs) return;
+
+    int want = capacity * 2 < config.ctrl_queue_max_msgs ? capacity * 2 : config.ctrl_queue_max_msgs;
+    int got = sysv_set_capacity(control_qid, want, sizeof(CommandMessage) - sizeof(long));
+    if (got > capacity) {
+        atomic_store_explicit(&ctrl_queue_capacity, got, memory_order_relaxed);
+        printf("Transport: Control Queue %d%% full, capacity raised %d -> %d messages.\n", pct, capacity, got);
+    } else {
+        // ขยายไม่ได้แล้ว (ติด msgmnb): หยุดพยายาม
+        config.ctrl_queue_max_msgs = capacity;
+    }
+}
+
+static int sysv_init(void) {
+    control_qid = msgget(CONTROL_QUEUE_KEY, IPC_CREAT | 0666);
+    if (control_qid == -1) {
+        perror("msgget (server)");
+        return -1;
+    }
+    int capacity = sysv_set_capacity(control_qid, config.ctrl_queue_msgs, sizeof(CommandMessage) - sizeof(long));
+    if (capacity == -1) {
+        perror("msgctl IPC_SET (control queue)");
+        capacity = 0;
+    }
+    atomic_store_explicit(&ctrl_queue_capacity, capacity, memory_order_relaxed);
+    printf("Transport: System V message queues (Control QID: %d, capacity %d messages).\n", control_qid, capacity);
+    if (capacity > 0 && capacity < config.ctrl_queue_msgs) {
+        printf("Transport: Requested %d messages but limited by kernel.msgmnb (needs CAP_SYS_RESOURCE or a larger sysctl).\n",
+               config.ctrl_queue_msgs);
+        config.ctrl_queue_max_msgs = capacity;
+    }
+    return 0;
+}
+
+static int sysv_recv_command(CommandMessage* cmd) {
+    static unsigned int received = 0;
+
+    if (++received % CTRL_QUEUE_SAMPLE == 0) sysv_control_adapt();
+    while (1) {
+        // อ่านจาก Control Queue (Blocking)
+        ssize_t size = msgrcv(control_qid, cmd, sizeof(CommandMessage) - sizeof(long), MSG_TYPE_COMMAND, 0);
+        if (size != -1) return 0;
+
+        if (errno == EINTR) continue;
+        if (errno == EIDRM) {
+            printf("\nRouter: Control Queue removed. Exiting router thread...\n");
+            return -1; // Server กำลังปิดตัว
+        }
+        perror("msgrcv (router)");
+    }
+}
+
+static int sysv_send_reply(int endpoint, const ReplyMessage* reply) {
+    // ใช้ IPC_NOWAIT เพื่อ Performance และจัดการ Queue Full
+    if (msgsnd(endpoint, reply, sizeof(ReplyMessage) - sizeof(long), IPC_NOWAIT) == -1) {
+        // Linux คืน EINVAL (ไม่ใช่ EIDRM) เมื่อคิวถูกลบไปแล้ว: ถือว่าปลายทางตายเหมือน sysv_probe
+        return (errno == EINVAL || errno == EIDRM) ? EIDRM : errno;
+    }
+    return 0;
+}
+
+static int sysv_probe(int endpoint, EndpointStats* st) {
+    struct msqid_ds ds;
+    if (msgctl(endpoint, IPC_STAT, &ds) == -1) {
+        return (errno == EINVAL || errno == EIDRM) ? EIDRM : errno;
+    }
+    // ยังไม่เคยมีการอ่าน: นับจากเวลาที่ Client สร้าง/ตั้งค่าคิว
+    time_t last_read = ds.msg_rtime > ds.msg_ctime ? ds.msg_rtime : ds.msg_ctime;
+    st->backlog = (int)ds.msg_qnum;
+    st->idle_ms = (int64_t)difftime(time(NULL), last_read) * 1000;
+    return 0;
+}
+
+static void sysv_shutdown(void) {
+    // ลบ Control Queue เพื่อยุติ Router thread
+    if (control_qid != -1 && msgctl(control_qid, IPC_RMID, NULL) == 0) {
+        printf("Control Queue removed successfully.\n");
+    } else if (control_qid != -1 && errno != EIDRM) {
+        perror("Failed to remove Control Queue");
+    }
+}
+
+static const ServerTransport sysv_transport = {
+    "sysv", sysv_init, sysv_recv_command, sysv_send_reply, sysv_probe, sysv_shutdown
+};
+
+// --- Transport Backend: Unix Domain Socket (SOCK_SEQPACKET + edge-triggered epoll) ---
+// Router เป็นผู้รัน Event Loop เอง: recv_command() วน epoll_wait และอ่านทีละ 1 Frame จาก Ready List
+// (Round-robin ระหว่าง Connection เพื่อไม่ให้ Client คนเดียวผูกขาด Router)
+// Broadcaster เขียนลง Outbox ของแต่ละ Connection แล้ว Flush ด้วย sendmmsg (หลาย Frame ต่อ 1 syscall)
+
+typedef struct {
+    int fd;                         // -1 = Slot ว่าง
+    uint32_t gen;                   // เพิ่มทุกครั้งที่ Slot ถูกปิด เพื่อให้ Endpoint เก่าใช้ไม่ได้
+    pid_t pid;                      // PID/Session ที่ Client ประกาศในคำสั่งล่าสุด (ใช้สร้าง CMD_QUIT เมื่อหลุด)
+    SessionId session_id;
+    int in_ready;                   // อยู่ใน Ready List แล้วหรือไม่ (Router เท่านั้น)
+    pthread_mutex_t lock;           // ป้องกัน fd/gen/outbox จาก Broadcaster หลายตัว
+    ReplyMessage outbox[SOCK_OUTBOX_SIZE];
+    int out_head, out_count;
+    int64_t last_drain_ns;          // เวลาล่าสุดที่ Kernel รับ Frame ได้ (Client ยังอ่านอยู่)
+} SockConn;
+
+#define SOCK_LISTEN_TAG 0xFFFFFFFFu
+
+SockConn sock_conns[SOCK_MAX_CONNS];
+int sock_listen_fd = -1;
+int sock_epoll_fd = -1;
+int sock_ready[SOCK_MAX_CONNS];    // Ring buffer ของ Slot ที่ยังมีข้อมูลค้างให้อ่าน
+int sock_ready_head = 0, sock_ready_count = 0;
+CommandMessage sock_pending_quit;  // CMD_QUIT ที่สร้างขึ้นเมื่อ Connection หลุด
+
+static int sock_endpoint(int slot) {
+    return (int)(((sock_conns[slot].gen & 0x7FFF) << 16) | (uint32_t)slot);
+}
+
+static void sock_ready_push(int slot) {
+    if (sock_conns[slot].in_ready) return;
+    sock_conns[slot].in_ready = 1;
+    sock_ready[(sock_ready_head + sock_ready_count) % SOCK_MAX_CONNS] = slot;
+    sock_ready_count++;
+}
+
+static int sock_ready_pop(void) {
+    int slot = sock_ready[sock_ready_head];
+    sock_ready_head = (sock_ready_head + 1) % SOCK_MAX_CONNS;
+    sock_ready_count--;
+    sock_conns[slot].in_ready = 0;
+    return slot;
+}
+
+/**
+ * @brief ส่ง Frame ที่ค้างใน Outbox ด้วย sendmmsg (ต้องถือ conn->lock)
+ * @return 0 หากส่งหมดหรือ Socket เต็ม (รอ EPOLLOUT), หรือ errno หาก Connection เสีย
+ */
+static int sock_flush_locked(SockConn* c) {
+    while (c->out_count > 0) {
+        struct mmsghdr msgs[SOCK_SEND_BATCH];
+        struct iovec iov[SOCK_SEND_BATCH];
+        int n = c->out_count < SOCK_SEND_BATCH ? c->out_count : SOCK_SEND_BATCH;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * n);
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = &c->outbox[(c->out_head + i) % SOCK_OUTBOX_SIZE];
+            iov[i].iov_len = sizeof(ReplyMessage);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sent = sendmmsg(c->fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            c->out_count = 0; // Connection เสีย: ทิ้ง Frame ที่ค้าง
+            return errno;
+        }
+        c->out_head = (c->out_head + sent) % SOCK_OUTBOX_SIZE;
+        c->out_count -= sent;
+        c->last_drain_ns = now_ns();
+        if (sent < n) return 0; // Socket เต็มระหว่างทาง
+    }
+    return 0;
+}
+
+static void sock_close(int slot) {
+    SockConn* c = &sock_conns[slot];
+    pthread_mutex_lock(&c->lock);
+    close(c->fd); // close() ถอด fd ออกจาก epoll ให้อัตโนมัติ
+    c->fd = -1;
+    c->gen++;
+    c->pid = 0;
+    c->session_id = 0;
+    c->out_head = c->out_count = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void sock_accept_all(void) {
+    while (1) {
+        int fd = accept4(sock_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept4");
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        int slot = -1;
+        for (int i = 0; i < SOCK_MAX_CONNS; i++) {
+            if (sock_conns[i].fd == -1) { slot = i; break; }
+        }
+        if (slot == -1) {
+            fprintf(stderr, "Transport: Connection table full. Rejecting connection.\n");
+            close(fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&sock_conns[slot].lock);
+        sock_conns[slot].fd = fd;
+        sock_conns[slot].last_drain_ns = now_ns();
+        pthread_mutex_unlock(&sock_conns[slot].lock);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)slot;
+        if (epoll_ctl(sock_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl (add)");
+            sock_close(slot);
+        }
+    }
+}
+
+static int sock_init(void) {
+    for (int i = 0; i < SOCK_MAX_CONNS; i++) {
+        sock_conns[i].fd = -1;
+        pthread_mutex_init(&sock_conns[i].lock, NULL);
+    }
+
+    sock_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_listen_fd == -1) {
+        perror("socket (server)");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", config.socket_path);
+    unlink(config.socket_path); // ลบ Socket ค้างจากรอบก่อน
+
+    if (bind(sock_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(sock_listen_fd, SOMAXCONN) == -1) {
+        perror("bind/listen (server)");
+        return -1;
+    }
+    chmod(config.socket_path, 0666);
+
+    sock_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sock_epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u32 = SOCK_LISTEN_TAG;
+    if (epoll_ctl(sock_epoll_fd, EPOLL_CTL_ADD, sock_listen_fd, &ev) == -1) {
+        perror("epoll_ctl (listen)");
+        return -1;
+    }
+
+    printf("Transport: Unix domain socket %s (SOCK_SEQPACKET + epoll).\n", config.socket_path);
+    return 0;
+}
+
+static int sock_recv_command(CommandMessage* cmd) {
+    struct epoll_event events[SOCK_EPOLL_EVENTS];
+
+    while (1) {
+        // 1. อ่านจาก Connection ที่มีข้อมูลค้าง (Edge-triggered: ต้องอ่านจนได้ EAGAIN)
+        while (sock_ready_count > 0) {
+            int slot = sock_ready_pop();
+            SockConn* c = &sock_conns[slot];
+            if (c->fd == -1) continue;
+
+            ssize_t n = recv(c->fd, cmd, sizeof(CommandMessage), MSG_DONTWAIT);
+            if (n == (ssize_t)sizeof(CommandMessage)) {
+                sock_ready_push(slot); // อาจยังมี Frame ค้าง: กลับมาอ่านต่อในรอบถัดไป
+                c->pid = cmd->sender_pid;
+                c->session_id = cmd->session_id;
+                cmd->reply_qid = sock_endpoint(slot); // Endpoint ถูกกำหนดโดย Server เสมอ
+                return 0;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue; // อ่านหมดแล้ว รอ Edge ถัดไป
+            if (n == -1 && errno == EINTR) { sock_ready_push(slot); continue; }
+            if (n > 0) {
+                fprintf(stderr, "Transport: Dropping malformed frame (%zd bytes) from slot %d.\n", n, slot);
+                sock_ready_push(slot);
+                continue;
+            }
+
+            // EOF หรือ Error: Client หลุด ให้สร้าง CMD_QUIT แทน Client
+            pid_t pid = c->pid;
+            SessionId session = c->session_id;
+            int endpoint = sock_endpoint(slot);
+            sock_close(slot);
+            if (pid != 0) {
+                memset(cmd, 0, sizeof(CommandMessage));
+                cmd->mtype = MSG_TYPE_COMMAND;
+                cmd->command = CMD_QUIT;
+                cmd->sender_pid = pid;
+                cmd->session_id = session; // Session อื่นบน Connection เดียวกันจะถูก Health Thread Evict
+                cmd->reply_qid = endpoint;
+                return 0;
+            }
+        }
+
+        // 2. รอ Event ใหม่
+        int nev = epoll_wait(sock_epoll_fd, events, SOCK_EPOLL_EVENTS, -1);
+        if (nev == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait (router)");
+            return -1;
+        }
+        for (int i = 0; i < nev; i++) {
+            uint32_t tag = events[i].data.u32;
+            if (tag == SOCK_LISTEN_TAG) {
+                if (atomic_load_explicit(&server_stopping, memory_order_relaxed)) return -1; // Server กำลังปิดตัว
+                sock_accept_all();
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                sock_ready_push((int)tag);
+            }
+            if (events[i].events & EPOLLOUT) {
+                SockConn* c = &sock_conns[tag];
+                pthread_mutex_lock(&c->lock);
+                if (c->fd != -1) sock_flush_locked(c);
+                pthread_mutex_unlock(&c->lock);
+            }
+        }
+    }
+}
+
+static int sock_send_reply(int endpoint, const ReplyMessage* reply) {
+    int slot = endpoint & 0xFFFF;
+    if (endpoint < 0 || slot >= SOCK_MAX_CONNS) return EINVAL;
+
+    SockConn* c = &sock_conns[slot];
+    int err = 0;
+    pthread_mutex_lock(&c->lock);
+    if (c->fd == -1 || (int)(c->gen & 0x7FFF) != (endpoint >> 16)) {
+        err = EIDRM; // Connection ปิดไปแล้ว (เทียบเท่าคิวถูกลบ)
+    } else if (c->out_count == SOCK_OUTBOX_SIZE) {
+        err = EAGAIN; // Outbox เต็ม: ทิ้งข้อความเหมือน IPC_NOWAIT
+    } else {
+        c->outbox[(c->out_head + c->out_count) % SOCK_OUTBOX_SIZE] = *reply;
+        c->out_count++;
+        err = sock_flush_locked(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+static int sock_probe(int endpoint, EndpointStats* st) {
+    int slot = endpoint & 0xFFFF;
+    if (endpoint < 0 || slot >= SOCK_MAX_CONNS) return EINVAL;
+
+    SockConn* c = &sock_conns[slot];
+    int err = 0;
+    pthread_mutex_lock(&c->lock);
+    if (c->fd == -1 || (int)(c->gen & 0x7FFF) != (endpoint >> 16)) {
+        err = EIDRM;
+    } else {
+        // Frame ค้างใน Outbox แปลว่า Socket Buffer ของ Client เต็ม (Client ไม่อ่าน)
+        st->backlog = c->out_count;
+        st->idle_ms = c->out_count > 0 ? (now_ns() - c->last_drain_ns) / 1000000 : 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+static void sock_shutdown(void) {
+    if (sock_listen_fd != -1) {
+        // shutdown() ทำให้ Listener รายงาน EPOLLHUP และปลุก Router ที่รออยู่ใน epoll_wait (fd ถูกปิดตอน exit)
+        shutdown(sock_listen_fd, SHUT_RDWR);
+        unlink(config.socket_path);
+        printf("Server socket %s removed successfully.\n", config.socket_path);
+    }
+}
+
+static const ServerTransport sock_transport = {
+    "unix", sock_init, sock_recv_command, sock_send_reply, sock_probe, sock_shutdown
+};
+
 // --- IPC Helper: Broadcaster Logic ---
 
 /**
- * @brief ส่งข้อความ ReplyMessage ไปยัง Message Queue ID ที่ระบุ
- * @details ใช้ IPC_NOWAIT เพื่อให้ Broadcaster Pool ไม่ถูกบล็อกแม้ Reply Queue ของ Client จะเต็ม (Queue Full) 
+ * @brief สร้าง Frame ของ ReplyMessage ครั้งเดียวสำหรับ Fan-out (ผู้เรียกตั้ง mtype เองต่อผู้รับ)
+ */
+static void render_reply(ReplyMessage* reply, const char* sender, const char* text, const LatencyStamps* stamps) {
+    reply->stamps = *stamps;
+    reply->queue_capacity = 0;
+    strncpy(reply->sender, sender, MAX_USERNAME - 1);
+    reply->sender[MAX_USERNAME - 1] = '\0';
+    strncpy(reply->text, text, MAX_TEXT_SIZE - 1);
+    reply->text[MAX_TEXT_SIZE - 1] = '\0';
+}
+
+/**
+ * @brief ส่ง Frame ที่สร้างไว้แล้วไปยัง Endpoint ที่ระบุผ่าน Transport ที่เลือกไว้
+ * @details Transport ทุกตัวส่งแบบไม่บล็อก เพื่อให้ Broadcaster Pool ไม่ถูกบล็อกแม้ปลายทางของ Client จะเต็ม (Queue Full) 
  * หากเต็มจะทิ้งข้อความ (Drop) เพื่อรักษา Throughput ของ Server
- * @param target_qid ID คิวเป้าหมาย (reply_qid ของ Client)
- * @param sender ชื่อผู้ส่งสำหรับแสดงผล
- * @param text เนื้อหาข้อความ
+ * @param target_qid Endpoint เป้าหมาย (reply_qid ของ Client)
+ * @param reply Frame ที่ render_reply() สร้างไว้ พร้อม mtype ของผู้รับ
+ * @return 0 หากส่งสำเร็จ หรือ errno (EIDRM = ปลายทางถูกลบแล้ว)
  */
-void send_reply(int target_qid, const char* sender, const char* text) {
-    ReplyMessage reply;
-    reply.mtype = MSG_TYPE_BROADCAST;
-    strncpy(reply.sender, sender, MAX_USERNAME - 1);
-    reply.sender[MAX_USERNAME - 1] = '\0';
-    strncpy(reply.text, text, MAX_TEXT_SIZE - 1);
-    reply.text[MAX_TEXT_SIZE - 1] = '\0';
-
-    // *** การปรับปรุงสำหรับ 100 คะแนน: ใช้ IPC_NOWAIT เพื่อ Performance และจัดการ Queue Full ***
-    if (msgsnd(target_qid, &reply, sizeof(ReplyMessage) - sizeof(long), IPC_NOWAIT) == -1) {
-        if (errno == EIDRM) {
-             // คิวถูกลบแล้ว (Client ปิดตัวไปแล้ว) ให้เพิกเฉย
-             // หากไม่ถูกเพิกเฉยจะเกิด Warning ทุกครั้งที่มีการ Broadcast 
-        } else if (errno == EAGAIN) {
+int send_frame(int target_qid, const ReplyMessage* reply) {
+    int err = transport->send_reply(target_qid, reply);
+    if (err != 0) {
+        if (err == EIDRM) {
+             // คิวถูกลบแล้ว (Client ปิดตัวไปแล้ว): ผู้เรียกจะแจ้ง Health Subsystem ให้ Evict
+             // ไม่พิมพ์ Warning เพราะจะเกิดทุกครั้งที่มีการ Broadcast 
+        } else if (err == EAGAIN) {
+             atomic_fetch_add_explicit(&reply_drops, 1, memory_order_relaxed);
              // คิวเต็ม (Queue Full): ทิ้งข้อความนี้ไป เพื่อรักษา Throughput ของ Broadcaster Pool
              fprintf(stderr, "Broadcaster: Warning - Reply Queue (QID %d) is full (EAGAIN). Message dropped.\n", 
                      target_qid);
         } else {
              // ข้อผิดพลาดอื่นๆ ที่ไม่คาดคิด
-             fprintf(stderr, "Broadcaster: Warning - msgsnd failed to QID %d. Error: %s\n", 
-                     target_qid, strerror(errno));
+             fprintf(stderr, "Broadcaster: Warning - send failed to QID %d. Error: %s\n", 
+                     target_qid, strerror(err));
         }
     }
+    return err;
+}
+
+/**
+ * @brief สร้าง Frame และส่งไปยังผู้รับรายเดียว
+ * @param mtype MSG_TYPE_REPLY (ด่วน), MSG_TYPE_BROADCAST (Bulk) หรือ Session ID ของ Logical Session
+ * @param stamps Latency Stamp ของคำสั่งต้นทาง (ส่งต่อให้ Client วัด Latency แยกตาม Stage)
+ * @return 0 หากส่งสำเร็จ หรือ errno (EIDRM = ปลายทางถูกลบแล้ว)
+ */
+int send_reply(int target_qid, long mtype, const char* sender, const char* text, const LatencyStamps* stamps) {
+    ReplyMessage reply;
+    render_reply(&reply, sender, text, stamps);
+    reply.mtype = mtype;
+    return send_frame(target_qid, &reply);
 }
 
 /**
  * @brief Worker thread function สำหรับ Broadcaster Pool
  */
 void* broadcaster_thread(void* arg) {
-    // int thread_id = (int)(intptr_t)arg; // สำหรับ Debug
     while (1) {
         Job* job = get_job(); // บล็อกจนกว่าจะมีงาน
+        if (job == NULL) break; // ถูกปลดออกจาก Pool เพราะว่างนานเกินไป
+        int64_t started = now_ns();
 
         // จัดการงานตามประเภท
-        if (job->type == CMD_MSG) {
-            // --- กระจายข้อความ (Broadcast) ต้องใช้ READ Lock ---
-            pthread_rwlock_rdlock(&registry.rwlock);
-            int room_idx = find_room_index(job->target_channel);
-            
-            if (room_idx != -1) {
-                // ส่งไปยังสมาชิกทั้งหมดในห้อง
-                for (int i = 0; i < registry.rooms[room_idx].member_count; i++) {
-                    pid_t member_pid = registry.rooms[room_idx].members[i];
-                    int client_idx = find_client_index(member_pid);
-
-                    if (client_idx != -1) {
-                        // [FIXED] ส่งให้สมาชิกทุกคนในห้อง รวมถึงผู้ส่ง (สำหรับ Probe RTT)
-                        send_reply(registry.clients[client_idx].reply_qid, job->sender_name, job->message);
-                    }
-                    
-                    // if (client_idx != -1) {
-                    //     // ไม่ส่งข้อความกลับไปหาผู้ส่งเอง (sender_name คือ "[#channel] User PID")
-                    //     char sender_pid_str[10];
-                    //     // ต้องใช้ sscanf ที่ปลอดภัยกว่าการ substring เพื่อดึง PID จาก Sender Name
-                    //     if (sscanf(job->sender_name, "[%*[^]]] User %s", sender_pid_str) == 1) {
-                    //         pid_t sender_pid = (pid_t)atoi(sender_pid_str);
-                    //         if (member_pid != sender_pid) {
-                    //             send_reply(registry.clients[client_idx].reply_qid, job->sender_name, job->message);
-                    //         }
-                    //     }
-                    // }
+        if (job->type == CMD_MSG || job->type == CMD_PUB || job->type == CMD_MULTICAST || job->type == CMD_ANNOUNCE) {
+            // --- Fan-out: PUB/MULTICAST/ANNOUNCE ถูก Resolve (และตัดซ้ำ) เป็น QID ไว้แล้วตอนที่ Handler สร้างงาน ---
+            // CMD_MSG อ่านสมาชิกห้องตอนส่งผ่าน Seqlock (ไม่ถือ READ Lock ระหว่าง msgsnd) ใช้ Frame เดียวกันทุกผู้รับ
+            const JobTarget* targets = job->targets;
+            int target_count = job->target_count;
+            JobTarget room[MAX_CLIENTS];
+            if (job->type == CMD_MSG) {
+                // [FIXED] ส่งให้สมาชิกทุกคนในห้อง รวมถึงผู้ส่ง (สำหรับ Probe RTT)
+                target_count = room_targets(job->target_channel, room);
+                targets = room;
+            }
+
+            ReplyMessage frame;
+            render_reply(&frame, job->sender_name, job->message, &job->stamps);
+            for (int i = 0; i < target_count; i++) {
+                // ข้ามผู้รับที่ถูกตรวจพบว่าตายระหว่างรอคิว (ไม่ต้องส่งซ้ำและไม่พิมพ์ Warning ทุกข้อความ)
+                if (atomic_load_explicit(&client_health[targets[i].slot].dead, memory_order_relaxed)) continue;
+                frame.mtype = targets[i].mtype ? targets[i].mtype : MSG_TYPE_BROADCAST;
+                if (send_frame(targets[i].qid, &frame) == EIDRM) {
+                    // Slot อาจถูกใช้ใหม่แล้วหลัง Snapshot: หาเจ้าของจาก QID แทน
+                    health_mark_dead_qid(targets[i].qid);
                 }
             }
-            pthread_rwlock_unlock(&registry.rwlock);
 
-        } else if (job->type == CMD_DM || job->type == CMD_WHO || job->type == CMD_REGISTER || job->type == CMD_QUIT || job->type == CMD_LEAVE) {
+        } else if (job->type == CMD_DM || job->type == CMD_WHO || job->type == CMD_REGISTER || job->type == CMD_QUIT ||
+                   job->type == CMD_LEAVE || job->type == CMD_MAIL) {
             // --- Direct message หรือ Reply ทั่วไป (ส่งไปยัง QID เดียว) ---
-            send_reply(job->target_qid, job->sender_name, job->message);
+            ReplyMessage frame;
+            render_reply(&frame, job->sender_name, job->message, &job->stamps);
+            frame.mtype = job->target_mtype ? job->target_mtype : MSG_TYPE_REPLY;
+            if (job->type == CMD_REGISTER) frame.queue_capacity = job->queue_capacity; // Welcome เท่านั้น
+            int err = send_frame(job->target_qid, &frame);
+            if (err == EIDRM) {
+                health_mark_dead_qid(job->target_qid);
+            }
+            // จดหมายจาก Mailbox ถูกนับว่าส่งแล้วเมื่อเข้า Reply Queue สำเร็จเท่านั้น
+            if (job->type == CMD_MAIL) mailbox_sent(job->mail_offset, err == 0);
         }
 
         free(job); // คืนหน่วยความจำของ Job
+        atomic_fetch_add_explicit(&pool_busy_ns, now_ns() - started, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/**
+ * @brief สร้าง Broadcaster Worker ใหม่แบบ Detached (pool_size ต้องถูกนับเพิ่มไว้ก่อนแล้ว)
+ * @return 0 หากสำเร็จ, -1 หากสร้าง Thread ไม่ได้
+ */
+int pool_spawn_worker() {
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&tid, &attr, broadcaster_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0) {
+        fprintf(stderr, "Broadcaster: Failed to spawn worker: %s\n", strerror(rc));
+        pthread_mutex_lock(&job_mutex);
+        pool_size--;
+        pthread_mutex_unlock(&job_mutex);
+        return -1;
+    }
+    return 0;
+}
+
+// --- Presence Coalescing (Join/Leave Digest) ---
+// แทนที่จะ Broadcast ทุกครั้งที่มีคน Join/Leave (O(N) ต่อ Event => O(N^2) เมื่อ N คน Reconnect พร้อมกัน)
+// Event จะถูกสะสมต่อห้องเป็นเวลา presence_window_ms แล้วส่งเป็น Digest เดียว
+
+/**
+ * @brief จัดรูปแบบรายชื่อตัวอย่าง เช่น " (alice, User 102, ...)"
+ */
+static int format_sample(char* buf, size_t size, const char (*sample)[MAX_USERNAME], int count) {
+    int shown = count < PRESENCE_SAMPLE ? count : PRESENCE_SAMPLE;
+    int written = snprintf(buf, size, " (");
+    for (int i = 0; i < shown && (size_t)written < size; i++) {
+        written += snprintf(buf + written, size - written, "%s%s", i ? ", " : "", sample[i]);
+    }
+    if ((size_t)written < size) {
+        written += snprintf(buf + written, size - written, "%s)", count > shown ? ", ..." : "");
+    }
+    return written;
+}
+
+/**
+ * @brief สร้าง Broadcast Job จาก Presence Buffer แล้วล้าง Buffer (ต้องถือ presence_mutex)
+ */
+static Job* presence_build_job(PresenceBuffer* pb) {
+    Job* job = (Job*)malloc(sizeof(Job));
+    job->type = CMD_MSG;
+    strcpy(job->sender_name, "SERVER");
+    strcpy(job->target_channel, pb->channel);
+
+    if (pb->joined == 1 && pb->left == 0) {
+        snprintf(job->message, MAX_TEXT_SIZE, "%s has joined the channel.", pb->joined_sample[0]);
+    } else if (pb->joined == 0 && pb->left == 1) {
+        snprintf(job->message, MAX_TEXT_SIZE, "%s has left the channel.", pb->left_sample[0]);
+    } else {
+        char* ptr = job->message;
+        size_t remaining = MAX_TEXT_SIZE;
+        int written = 0;
+        if (pb->joined > 0) {
+            written = snprintf(ptr, remaining, "+%d joined", pb->joined);
+            written += format_sample(ptr + written, remaining - written, pb->joined_sample, pb->joined);
+        }
+        if (pb->left > 0 && (size_t)written < remaining) {
+            written += snprintf(ptr + written, remaining - written, "%s-%d left", written ? ", " : "", pb->left);
+            if ((size_t)written < remaining) {
+                format_sample(ptr + written, remaining - written, pb->left_sample, pb->left);
+            }
+        }
+    }
+
+    memset(pb, 0, sizeof(PresenceBuffer));
+    return job;
+}
+
+/**
+ * @brief บันทึก Event การเข้า/ออกห้อง (เรียกได้ทั้งที่ถือ registry.rwlock อยู่)
+ * @param label ชื่อที่แสดงของ Client (ClientEntry.label) ถูกคัดลอกไว้ เพราะ Client อาจเปลี่ยนชื่อหรือออกก่อน Flush
+ * @param joined 1 = เข้าห้อง, 0 = ออกจากห้อง
+ */
+void presence_event(const char* channel, const char* label, int joined) {
+    PresenceBuffer* pb = NULL;
+    Job* flush_now = NULL;
+
+    pthread_mutex_lock(&presence_mutex);
+    for (int i = 0; i < MAX_CHANNELS && !pb; i++) {
+        if (strcmp(presence[i].channel, channel) == 0) pb = &presence[i];
+    }
+    for (int i = 0; i < MAX_CHANNELS && !pb; i++) {
+        if (presence[i].channel[0] == '\0') {
+            pb = &presence[i];
+            strcpy(pb->channel, channel);
+            pb->first_ns = now_ns();
+            pthread_cond_signal(&presence_cond); // ปลุก Presence Thread ให้ตั้งเวลา Flush
+        }
+    }
+
+    if (pb == NULL) {
+        // ไม่มี Slot ว่าง (ห้องหมุนเวียนเร็วมาก): ส่ง Event นี้ทันทีแบบไม่รวม
+        PresenceBuffer single;
+        memset(&single, 0, sizeof(single));
+        strcpy(single.channel, channel);
+        pb = &single;
+        if (joined) { strcpy(pb->joined_sample[pb->joined++], label); } else { strcpy(pb->left_sample[pb->left++], label); }
+        flush_now = presence_build_job(pb);
+    } else if (joined) {
+        if (pb->joined < PRESENCE_SAMPLE) strcpy(pb->joined_sample[pb->joined], label);
+        pb->joined++;
+    } else {
+        if (pb->left < PRESENCE_SAMPLE) strcpy(pb->left_sample[pb->left], label);
+        pb->left++;
+    }
+
+    if (!flush_now && config.presence_window_ms <= 0) {
+        flush_now = presence_build_job(pb); // ปิดการรวม Event
+    }
+    pthread_mutex_unlock(&presence_mutex);
+
+    if (flush_now) add_job(flush_now);
+}
+
+/**
+ * @brief Thread สำหรับส่ง Presence Digest ของแต่ละห้องเมื่อครบ presence_window_ms
+ */
+void* presence_thread(void* arg) {
+    pthread_mutex_lock(&presence_mutex);
+    while (1) {
+        int64_t window = (int64_t)config.presence_window_ms * 1000000;
+        int64_t now = now_ns();
+        int64_t next_deadline = -1;
+        Job* ready[MAX_CHANNELS];
+        int ready_count = 0;
+
+        for (int i = 0; i < MAX_CHANNELS; i++) {
+            if (presence[i].channel[0] == '\0') continue;
+            int64_t deadline = presence[i].first_ns + window;
+            if (deadline <= now) {
+                ready[ready_count++] = presence_build_job(&presence[i]);
+            } else if (next_deadline == -1 || deadline < next_deadline) {
+                next_deadline = deadline;
+            }
+        }
+
+        if (ready_count > 0) {
+            pthread_mutex_unlock(&presence_mutex);
+            for (int i = 0; i < ready_count; i++) add_job(ready[i]);
+            pthread_mutex_lock(&presence_mutex);
+            continue;
+        }
+
+        if (next_deadline == -1) {
+            pthread_cond_wait(&presence_cond, &presence_mutex);
+        } else {
+            struct timespec ts = { next_deadline / 1000000000LL, next_deadline % 1000000000LL };
+            pthread_cond_timedwait(&presence_cond, &presence_mutex, &ts);
+        }
     }
     return NULL;
 }
 
 // --- Registry Helpers (Access MUST be protected by registry.rwlock in handlers) ---
 
+/**
+ * @brief Session ID ที่คำสั่งนี้กระทำในนาม (Client ปกติ = PID ของผู้ส่ง)
+ */
+static SessionId cmd_session(const CommandMessage* cmd) {
+    return cmd->session_id != 0 ? cmd->session_id : (SessionId)cmd->sender_pid;
+}
+
+/**
+ * @brief mtype สำหรับตอบกลับผู้ส่งคำสั่งนี้ (0 = Client ปกติ ใช้ Priority Lane)
+ */
+static long cmd_reply_mtype(const CommandMessage* cmd) {
+    return cmd->session_id;
+}
+
 /**
  * @brief ค้นหาดัชนี Client ใน Registry
- * @param pid PID ของ Client
+ * @param session Session ID ของ Client (0 = หา Slot ว่าง)
  * @return ดัชนีในอาเรย์ clients หรือ -1 หากไม่พบ
  */
-int find_client_index(pid_t pid) {
+int find_client_index(SessionId session) {
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (registry.clients[i].pid == pid) return i;
+        if (registry.clients[i].session_id == session) return i;
     }
     return -1;
 }
@@ -193,76 +1049,766 @@ int find_room_index(const char* channel_name) {
     return -1;
 }
 
+// --- Nickname Directory (Hash Index: nick -> Client Slot, Linear Probing) ---
+
+static uint32_t fnv1a(const char* s) {
+    uint32_t h = 2166136261u;
+    for (const char* p = s; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+static uint32_t nick_hash(const char* nick) {
+    return fnv1a(nick) & (NICK_TABLE_SIZE - 1);
+}
+
 /**
- * @brief เพิ่ม Client เข้าสู่รายชื่อสมาชิก Room (ต้องเรียกภายใต้ WRITE Lock)
+ * @brief ตรวจรูปแบบชื่อเล่น: ขึ้นต้นด้วยตัวอักษร ตามด้วยตัวอักษร/ตัวเลข/'_'/'-' ยาวไม่เกิน NICK_MAX_LEN
+ * @details ชื่อที่ขึ้นต้นด้วยตัวเลขสงวนไว้ให้ Session ID เพื่อให้ DM แยกสองแบบออกจากกันได้
  */
-void add_client_to_room(int room_idx, pid_t pid) {
-    RoomEntry* room = &registry.rooms[room_idx];
-    for (int i = 0; i < room->member_count; i++) {
-        if (room->members[i] == pid) return; // เป็นสมาชิกอยู่แล้ว
-    }
-    if (room->member_count < MAX_CLIENTS) {
-        room->members[room->member_count++] = pid;
+static int nick_valid(const char* nick) {
+    size_t len = strlen(nick);
+    if (len == 0 || len > NICK_MAX_LEN || !isalpha((unsigned char)nick[0])) return 0;
+    for (size_t i = 1; i < len; i++) {
+        if (!isalnum((unsigned char)nick[i]) && nick[i] != '_' && nick[i] != '-') return 0;
     }
+    return 1;
 }
 
 /**
- * @brief ลบ Client ออกจากรายชื่อสมาชิก Room (ต้องเรียกภายใต้ WRITE Lock)
+ * @brief ค้นหา Client จากชื่อเล่น (ต้องเรียกภายใต้ Lock หรือใน copy() ของ registry_read)
+ * @return ดัชนีในอาเรย์ clients หรือ -1 หากไม่พบ
  */
-void remove_client_from_room(int room_idx, pid_t pid) {
-    RoomEntry* room = &registry.rooms[room_idx];
-    for (int i = 0; i < room->member_count; i++) {
-        if (room->members[i] == pid) {
-            // เลื่อนสมาชิกคนอื่นมาแทนที่
-            for (int j = i; j < room->member_count - 1; j++) {
-                room->members[j] = room->members[j + 1];
-            }
-            room->member_count--;
-            // ถ้า Channel ว่าง ให้เคลียร์ Channel นั้น
-            // *** System Event: "ห้องว่างแล้ว" ***
-            if (room->member_count == 0 && strcmp(room->channel_name, "#general") != 0) {
-                 printf("Router: Channel %s is now empty and will be cleared.\n", room->channel_name);
-                 memset(room, 0, sizeof(RoomEntry));
-                 registry.room_count--;
-            }
-            break;
-        }
+int nick_lookup(const char* nick) {
+    uint32_t b = nick_hash(nick);
+    for (int probe = 0; probe < NICK_TABLE_SIZE; probe++, b = (b + 1) & (NICK_TABLE_SIZE - 1)) {
+        int slot = nick_table[b] - 1;
+        if (slot < 0) return -1;
+        if (strcmp(registry.clients[slot].nick, nick) == 0) return slot;
     }
+    return -1;
 }
 
 /**
- * @brief ลบ Client ออกจากระบบทั้งหมด (ต้องเรียกภายใต้ WRITE Lock)
- * @details ใช้เมื่อ Client QUIT หรือเกิด Inactivity Timeout
+ * @brief เพิ่มชื่อเล่นของ Client ลง Directory (ต้องเรียกภายใต้ WRITE Lock, ชื่อต้องยังไม่ถูกใช้)
  */
-void remove_client(pid_t pid) {
-    int client_idx = find_client_index(pid);
-    if (client_idx == -1) return;
+static void nick_index_add(int client_idx) {
+    uint32_t b = nick_hash(registry.clients[client_idx].nick);
+    while (nick_table[b] != 0) b = (b + 1) & (NICK_TABLE_SIZE - 1);
+    nick_table[b] = client_idx + 1;
+}
 
-    // 1. นำออกจาก Channel ปัจจุบัน
-    char channel_to_leave[MAX_CHANNEL];
-    strcpy(channel_to_leave, registry.clients[client_idx].current_channel);
-    
+/**
+ * @brief ลบชื่อเล่นของ Client ออกจาก Directory (ต้องเรียกภายใต้ WRITE Lock)
+ * @details ใช้ Backward-shift Deletion: เลื่อน Entry ถัดไปที่ยังเข้าถึงช่องว่างได้กลับมาแทน
+ * จึงไม่ต้องมี Tombstone และการค้นหายังหยุดที่ Bucket ว่างได้เสมอ
+ */
+static void nick_index_remove(int client_idx) {
+    const uint32_t mask = NICK_TABLE_SIZE - 1;
+    if (registry.clients[client_idx].nick[0] == '\0') return;
+
+    uint32_t hole = nick_hash(registry.clients[client_idx].nick);
+    for (int probe = 0; nick_table[hole] != client_idx + 1; probe++, hole = (hole + 1) & mask) {
+        if (nick_table[hole] == 0 || probe == NICK_TABLE_SIZE) return;
+    }
+    for (uint32_t j = (hole + 1) & mask; nick_table[j] != 0; j = (j + 1) & mask) {
+        uint32_t home = nick_hash(registry.clients[nick_table[j] - 1].nick);
+        // ย้ายได้ถ้า hole อยู่ระหว่าง home กับ j (แบบวนรอบ)
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            nick_table[hole] = nick_table[j];
+            hole = j;
+        }
+    }
+    nick_table[hole] = 0;
+}
+
+/**
+ * @brief ประกอบ sender_name แบบ "[<tag>] <label>" ให้พอดี MAX_USERNAME
+ * @details label ยาวไม่เกิน 25 ตัวอักษร ("User " + Session ID หรือ nick) จึงใส่ได้ครบเสมอ
+ * ส่วน tag (ชื่อห้อง/Topic) ถูกตัดเท่าที่เหลือพื้นที่ (ประกอบเองแทน snprintf เพื่อคุมความยาวทุกส่วน)
+ */
+static void render_sender_name(char out[MAX_USERNAME], const char* tag, const char* label) {
+    size_t label_len = strnlen(label, MAX_USERNAME - 4);
+    size_t tag_len = strnlen(tag, MAX_USERNAME - 4 - label_len); // '[' + "] " + '\0'
+    char* p = out;
+    *p++ = '[';
+    memcpy(p, tag, tag_len); p += tag_len;
+    *p++ = ']'; *p++ = ' ';
+    memcpy(p, label, label_len);
+    p[label_len] = '\0';
+}
+
+/**
+ * @brief Render ชื่อที่แสดงของ Client ไว้ล่วงหน้า (ต้องเรียกภายใต้ WRITE Lock)
+ * @details เรียกตอน REGISTER/NICK (label) และ JOIN/LEAVE (msg_prefix) เพื่อให้ handle_msg
+ * แค่คัดลอก sender_name ไม่ต้องจัดรูปแบบทุกข้อความ
+ */
+static void client_render_names(int client_idx) {
+    ClientEntry* c = &registry.clients[client_idx];
+    char label[MAX_USERNAME], prefix[MAX_USERNAME];
+    if (c->nick[0] != '\0') {
+        snprintf(label, sizeof(label), "%.*s", NICK_MAX_LEN, c->nick);
+    } else {
+        snprintf(label, sizeof(label), "User %ld", c->session_id);
+    }
+    render_sender_name(prefix, c->current_channel, label);
+    memcpy(c->label, label, MAX_USERNAME);
+    memcpy(c->msg_prefix, prefix, MAX_USERNAME);
+}
+
+// --- Registry Seqlock (อ่านแบบไม่ต้องถือ Lock สำหรับ Handler ที่อ่านอย่างเดียว) ---
+// การเปลี่ยนโครงสร้าง (REGISTER/JOIN/LEAVE/QUIT/Evict) ยังใช้ WRITE Lock เหมือนเดิม แต่ต้องผ่าน
+// registry_write_lock/unlock เพื่อให้ registry.seq เป็นเลขคี่ตลอดช่วงที่แก้ไข
+
+static atomic_ullong registry_seq_fallbacks = 0; // จำนวนครั้งที่ Reader ต้องถอยไปใช้ READ Lock (เพิ่มเฉพาะกรณีช้า)
+
+/**
+ * @brief ถือ WRITE Lock และเปิดช่วงแก้ไขของ Seqlock (seq เป็นเลขคี่)
+ */
+static void registry_write_lock() {
+    seqlock_write_begin(&registry);
+}
+
+/**
+ * @brief ปิดช่วงแก้ไขของ Seqlock (seq กลับเป็นเลขคู่) แล้วปล่อย WRITE Lock
+ */
+static void registry_write_unlock() {
+    seqlock_write_end(&registry);
+}
+
+/**
+ * @brief อ่าน Snapshot ของ Registry ผ่าน Seqlock (โปรโตคอลอยู่ใน registry_seqlock.h)
+ * @param copy ฟังก์ชันคัดลอกฟิลด์ที่ต้องการจาก registry ลง snap (ห้ามมี Side Effect)
+ * @param snap ที่เก็บ Snapshot
+ */
+static void registry_read(void (*copy)(void* snap), void* snap) {
+    seqlock_read(&registry, copy, snap, &registry_seq_fallbacks);
+}
+
+// Snapshot สำหรับ registry_read (ฟิลด์ที่ Handler อ่านอย่างเดียวต้องการ)
+typedef struct {
+    SessionId session;              // Input
+    int idx;                        // ดัชนีใน clients หรือ -1
+    char channel[MAX_CHANNEL];      // current_channel ของ Client
+    char prefix[MAX_USERNAME];      // msg_prefix ที่ Render ไว้แล้ว
+} ClientLookup;
+
+typedef struct {
+    SessionId sender, target;       // Input: target = 0 เมื่อระบุผู้รับด้วยชื่อเล่น
+    const char* target_nick;        // Input: ชื่อเล่นของผู้รับ (NULL = ใช้ target)
+    int sender_idx, target_idx;
+    int target_qid;
+    long target_mtype;
+    char sender_nick[NICK_MAX_LEN + 1];
+} DmLookup;
+
+typedef struct {
+    SessionId session;              // Input
+    const char* channel;            // Input
+    int client_idx, room_idx;
+    int member_count;
+    SessionId members[MAX_CLIENTS];
+    char nicks[MAX_CLIENTS][NICK_MAX_LEN + 1]; // "" = สมาชิกไม่ได้ตั้งชื่อเล่น
+} WhoLookup;
+
+// ผู้รับของงาน Fan-out (Resolve เป็น QID/mtype แล้วส่งนอก Lock)
+typedef struct {
+    const char* channel;            // Input: CMD_MSG = ห้องปลายทาง
+    JobTarget* targets;             // Input: Buffer ผู้รับ (MAX_CLIENTS ช่อง)
+    int target_count;
+} FanoutLookup;
+
+typedef struct {
+    SessionId session;              // Input
+    int command;                    // Input: CMD_MULTICAST หรือ CMD_ANNOUNCE
+    const char* channels;           // Input: รายชื่อห้องคั่นด้วย ',' (จบด้วย '\0' แล้ว)
+    int client_idx;
+    int rooms, unknown;
+    char nick[NICK_MAX_LEN + 1];
+    char label[MAX_USERNAME];
+    int target_count;
+    JobTarget targets[MAX_CLIENTS];
+} MulticastLookup;
+
+typedef struct {
+    SessionId session;              // Input
+    uint64_t mask;                  // Input: ผล Match จาก Topic Cache
+    unsigned generation;            // Input: topic_generation ตอนที่ mask ถูก Cache
+    int client_idx;
+    int stale;                      // Subscription เปลี่ยนหลัง Cache (mask ใช้ไม่ได้)
+    char label[MAX_USERNAME];
+    int target_count;
+    JobTarget targets[MAX_CLIENTS];
+} PubLookup;
+
+static void copy_client_lookup(void* snap) {
+    ClientLookup* l = snap;
+    l->idx = find_client_index(l->session);
+    if (l->idx != -1) {
+        memcpy(l->channel, registry.clients[l->idx].current_channel, MAX_CHANNEL);
+        memcpy(l->prefix, registry.clients[l->idx].msg_prefix, MAX_USERNAME);
+    }
+    l->channel[MAX_CHANNEL - 1] = '\0'; // อาจเห็นข้อมูลที่ขาดกลางคันในรอบที่จะถูกทิ้ง
+    l->prefix[MAX_USERNAME - 1] = '\0';
+}
+
+static void copy_dm_lookup(void* snap) {
+    DmLookup* l = snap;
+    l->sender_idx = find_client_index(l->sender);
+    l->sender_nick[0] = '\0';
+    if (l->sender_idx != -1) {
+        memcpy(l->sender_nick, registry.clients[l->sender_idx].nick, sizeof(l->sender_nick));
+        l->sender_nick[NICK_MAX_LEN] = '\0';
+    }
+    l->target_idx = l->target_nick ? nick_lookup(l->target_nick) : l->target > 0 ? find_client_index(l->target) : -1;
+    if (l->target_idx != -1) {
+        l->target_qid = registry.clients[l->target_idx].reply_qid;
+        l->target_mtype = registry.clients[l->target_idx].reply_mtype;
+    }
+}
+
+static void copy_who_lookup(void* snap) {
+    WhoLookup* l = snap;
+    l->client_idx = find_client_index(l->session);
+    l->room_idx = find_room_index(l->channel);
+    l->member_count = 0;
+    if (l->room_idx != -1) {
+        int count = registry.rooms[l->room_idx].member_count;
+        l->member_count = count < 0 ? 0 : count > MAX_CLIENTS ? MAX_CLIENTS : count;
+        memcpy(l->members, registry.rooms[l->room_idx].members, l->member_count * sizeof(SessionId));
+    }
+    for (int i = 0; i < l->member_count; i++) {
+        int idx = find_client_index(l->members[i]);
+        l->nicks[i][0] = '\0';
+        if (idx != -1) memcpy(l->nicks[i], registry.clients[idx].nick, NICK_MAX_LEN);
+        l->nicks[i][NICK_MAX_LEN] = '\0';
+    }
+}
+
+/**
+ * @brief เพิ่ม Slot ลงรายชื่อผู้รับ (ข้าม Client ที่ถูกตรวจพบว่าตายแล้ว รอ Health Thread Evict)
+ */
+static void lookup_add_target(JobTarget* targets, int* count, int slot) {
+    if (atomic_load_explicit(&client_health[slot].dead, memory_order_relaxed)) return;
+    targets[*count].qid = registry.clients[slot].reply_qid;
+    targets[*count].mtype = registry.clients[slot].reply_mtype;
+    targets[*count].slot = slot;
+    (*count)++;
+}
+
+static void copy_fanout_lookup(void* snap) {
+    FanoutLookup* l = snap;
+    int room_idx = find_room_index(l->channel);
+    l->target_count = 0;
+    if (room_idx == -1) return;
+    int count = registry.rooms[room_idx].member_count;
+    if (count > MAX_CLIENTS) count = MAX_CLIENTS;
+    for (int i = 0; i < count; i++) {
+        int idx = find_client_index(registry.rooms[room_idx].members[i]);
+        if (idx != -1) lookup_add_target(l->targets, &l->target_count, idx);
+    }
+}
+
+/**
+ * @brief ผู้รับทุกคนในห้อง (รวมผู้ส่ง) สำหรับงาน CMD_MSG อ่านผ่าน Seqlock
+ * @return จำนวนผู้รับที่เขียนลง targets
+ */
+static int room_targets(const char* channel, JobTarget targets[MAX_CLIENTS]) {
+    FanoutLookup room = { .channel = channel, .targets = targets };
+    registry_read(copy_fanout_lookup, &room);
+    return room.target_count;
+}
+
+static void copy_multicast_lookup(void* snap) {
+    MulticastLookup* l = snap;
+    uint64_t mask = 0;
+    l->rooms = l->unknown = l->target_count = 0;
+    l->nick[0] = l->label[0] = '\0';
+    l->client_idx = find_client_index(l->session);
+    if (l->client_idx == -1) return;
+    memcpy(l->nick, registry.clients[l->client_idx].nick, NICK_MAX_LEN);
+    memcpy(l->label, registry.clients[l->client_idx].label, MAX_USERNAME);
+    l->nick[NICK_MAX_LEN] = '\0';
+    l->label[MAX_USERNAME - 1] = '\0';
+
+    // รวมผู้รับเป็น Slot Mask (สมาชิกที่อยู่หลายห้องจะถูกนับครั้งเดียว)
+    if (l->command == CMD_ANNOUNCE) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (registry.clients[i].session_id != 0) mask |= 1ULL << i;
+        }
+    } else {
+        char list[MAX_CHANNEL_LIST]; // strtok_r แก้ไข Buffer: ใช้สำเนาใหม่ทุกรอบที่อ่าน
+        snprintf(list, sizeof(list), "%s", l->channels);
+        for (char *save = NULL, *ch = strtok_r(list, ",", &save); ch; ch = strtok_r(NULL, ",", &save)) {
+            int room_idx = find_room_index(ch);
+            if (room_idx == -1) { l->unknown++; continue; }
+            l->rooms++;
+            int count = registry.rooms[room_idx].member_count;
+            if (count > MAX_CLIENTS) count = MAX_CLIENTS;
+            for (int m = 0; m < count; m++) {
+                int idx = find_client_index(registry.rooms[room_idx].members[m]);
+                if (idx != -1) mask |= 1ULL << idx;
+            }
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (mask & (1ULL << i)) lookup_add_target(l->targets, &l->target_count, i);
+    }
+}
+
+static void copy_pub_lookup(void* snap) {
+    PubLookup* l = snap;
+    l->target_count = 0;
+    l->label[0] = '\0';
+    l->client_idx = find_client_index(l->session);
+    l->stale = l->generation != topic_generation;
+    if (l->client_idx == -1 || l->stale) return;
+    memcpy(l->label, registry.clients[l->client_idx].label, MAX_USERNAME);
+    l->label[MAX_USERNAME - 1] = '\0';
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if ((l->mask & (1ULL << i)) && registry.clients[i].session_id != 0) {
+            lookup_add_target(l->targets, &l->target_count, i);
+        }
+    }
+}
+
+/**
+ * @brief เพิ่ม Client เข้าสู่รายชื่อสมาชิก Room (ต้องเรียกภายใต้ WRITE Lock)
+ */
+void add_client_to_room(int room_idx, SessionId session) {
+    RoomEntry* room = &registry.rooms[room_idx];
+    for (int i = 0; i < room->member_count; i++) {
+        if (room->members[i] == session) return; // เป็นสมาชิกอยู่แล้ว
+    }
+    if (room->member_count < MAX_CLIENTS) {
+        room->members[room->member_count++] = session;
+    }
+}
+
+/**
+ * @brief ลบ Client ออกจากรายชื่อสมาชิก Room (ต้องเรียกภายใต้ WRITE Lock)
+ */
+void remove_client_from_room(int room_idx, SessionId session) {
+    RoomEntry* room = &registry.rooms[room_idx];
+    for (int i = 0; i < room->member_count; i++) {
+        if (room->members[i] == session) {
+            // เลื่อนสมาชิกคนอื่นมาแทนที่
+            for (int j = i; j < room->member_count - 1; j++) {
+                room->members[j] = room->members[j + 1];
+            }
+            room->member_count--;
+            // ถ้า Channel ว่าง ให้เคลียร์ Channel นั้น
+            // *** System Event: "ห้องว่างแล้ว" ***
+            if (room->member_count == 0 && strcmp(room->channel_name, "#general") != 0) {
+                 printf("Router: Channel %s is now empty and will be cleared.\n", room->channel_name);
+                 memset(room, 0, sizeof(RoomEntry));
+                 registry.room_count--;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief ลบ Client ออกจากระบบทั้งหมด (ต้องเรียกภายใต้ WRITE Lock)
+ * @details ใช้เมื่อ Client QUIT หรือเกิด Inactivity Timeout
+ */
+void remove_client(SessionId session) {
+    int client_idx = find_client_index(session);
+    if (client_idx == -1) return;
+
+    // 1. นำออกจาก Channel ปัจจุบัน
+    char channel_to_leave[MAX_CHANNEL];
+    strcpy(channel_to_leave, registry.clients[client_idx].current_channel);
+    
     if (channel_to_leave[0] != '\0') {
         int room_idx = find_room_index(channel_to_leave);
         if (room_idx != -1) {
-            remove_client_from_room(room_idx, pid);
+            remove_client_from_room(room_idx, session);
             
-            // Broadcast แจ้งการออก
-            Job* leave_job = (Job*)malloc(sizeof(Job));
-            leave_job->type = CMD_MSG;
-            strcpy(leave_job->sender_name, "SERVER");
-            strcpy(leave_job->target_channel, channel_to_leave);
-            sprintf(leave_job->message, "User %d has left the chat.", pid);
-            add_job(leave_job);
+            // แจ้งการออก (รวมเป็น Presence Digest)
+            presence_event(channel_to_leave, registry.clients[client_idx].label, 0);
         }
     }
 
-    // 2. เคลียร์ Client Registry slot
+    // 2. ยกเลิก Topic Subscription ทั้งหมดของ Slot นี้
+    topic_remove_slot(client_idx);
+
+    // 3. ลบชื่อเล่นออกจาก Directory แล้วเคลียร์ Client Registry slot (Mailbox จำไว้ว่าเพิ่งมีคนใช้ชื่อนี้)
+    if (mailbox_enabled && registry.clients[client_idx].nick[0] != '\0') mailbox_seen(registry.clients[client_idx].nick);
+    nick_index_remove(client_idx);
     // msgctl(registry.clients[client_idx].reply_qid, IPC_RMID, NULL); // Client ควรลบคิวตัวเอง
     memset(&registry.clients[client_idx], 0, sizeof(ClientEntry));
     registry.client_count--;
     
-    printf("Router: Client %d was removed. Client Count: %d\n", pid, registry.client_count);
+    printf("Router: Client %ld was removed. Client Count: %d\n", session, registry.client_count);
+}
+
+
+// --- Topic Subscriptions (Trie + Match Cache) ---
+// Trie แก้ไขภายใต้ WRITE Lock ของ Registry (SUB/UNSUB/remove_client) และอ่านภายใต้ READ Lock (PUB ที่ Cache Miss)
+// ผล Match ของแต่ละ Topic ถูก Cache ไว้ (topic_cache_mutex) และหมดอายุเมื่อ topic_generation เปลี่ยน
+
+/**
+ * @brief แยก Topic/Pattern ("#ops.alerts.db") เป็น Segment
+ * @param allow_wildcard 1 = Pattern (ใช้ "*" ได้ทุกตำแหน่ง และ "**" ได้เฉพาะ Segment สุดท้าย)
+ * @return จำนวน Segment หรือ -1 หากรูปแบบไม่ถูกต้อง
+ */
+static int topic_split(const char* topic, char segs[TOPIC_MAX_DEPTH][MAX_CHANNEL], int allow_wildcard) {
+    char buf[MAX_CHANNEL];
+    int count = 0;
+
+    if (topic[0] != '#') return -1;
+    snprintf(buf, sizeof(buf), "%s", topic + 1);
+    for (char *save = NULL, *seg = strtok_r(buf, ".", &save); seg; seg = strtok_r(NULL, ".", &save)) {
+        if (count == TOPIC_MAX_DEPTH) return -1;
+        int wild = strcmp(seg, "*") == 0 || strcmp(seg, "**") == 0;
+        if (strchr(seg, '*') && !wild) return -1;      // "*" ต้องอยู่เดี่ยวๆ ใน Segment
+        if (wild && !allow_wildcard) return -1;
+        strcpy(segs[count++], seg);
+    }
+    // "." ซ้อนหรือขึ้นต้น/ลงท้ายด้วย "." ทำให้มี Segment ว่าง (strtok ข้ามไป)
+    if (count == 0 || strstr(topic, "..") || topic[1] == '.' || topic[strlen(topic) - 1] == '.') return -1;
+    for (int i = 0; i < count - 1; i++) {
+        if (strcmp(segs[i], "**") == 0) return -1;
+    }
+    return count;
+}
+
+/**
+ * @brief หา (หรือสร้าง) Child Node ที่มี Segment ตรงกัน
+ */
+static TopicNode* topic_child(TopicNode* node, const char* seg, int create) {
+    for (TopicNode* c = node->child; c; c = c->sibling) {
+        if (strcmp(c->segment, seg) == 0) return c;
+    }
+    if (!create || topic_node_count >= TOPIC_MAX_NODES) return NULL;
+
+    TopicNode* c = (TopicNode*)calloc(1, sizeof(TopicNode));
+    strcpy(c->segment, seg);
+    c->sibling = node->child;
+    node->child = c;
+    topic_node_count++;
+    return c;
+}
+
+/**
+ * @brief คืนหน่วยความจำของ Node ที่ไม่มีผู้ Subscribe และไม่มีลูกแล้ว
+ */
+static void topic_prune(TopicNode* node) {
+    TopicNode** link = &node->child;
+    while (*link) {
+        TopicNode* c = *link;
+        topic_prune(c);
+        if (c->exact == 0 && c->globstar == 0 && c->child == NULL) {
+            *link = c->sibling;
+            free(c);
+            topic_node_count--;
+        } else {
+            link = &c->sibling;
+        }
+    }
+}
+
+/**
+ * @brief เพิ่ม/ลบ Slot ของ Client ใน Pattern (ต้องเรียกภายใต้ WRITE Lock)
+ * @return 0 หากมีการเปลี่ยนแปลง, 1 หากไม่มีอะไรเปลี่ยน (Subscribe ซ้ำ/ไม่เคย Subscribe), -1 หาก Pattern ผิดหรือ Trie เต็ม
+ */
+static int topic_subscribe(const char* pattern, int slot, int subscribe) {
+    char segs[TOPIC_MAX_DEPTH][MAX_CHANNEL];
+    int count = topic_split(pattern, segs, 1);
+    if (count == -1) return -1;
+
+    int globstar = strcmp(segs[count - 1], "**") == 0;
+    if (globstar) count--;
+
+    TopicNode* node = &topic_root;
+    for (int i = 0; i < count && node; i++) {
+        node = topic_child(node, segs[i], subscribe);
+    }
+    if (node == NULL) {
+        if (subscribe) topic_prune(&topic_root); // Trie เต็มระหว่างสร้าง: คืน Node ที่สร้างค้างไว้
+        return subscribe ? -1 : 1;
+    }
+
+    uint64_t* mask = globstar ? &node->globstar : &node->exact;
+    uint64_t bit = 1ULL << slot;
+    if (((*mask & bit) != 0) == (subscribe != 0)) return 1;
+
+    if (subscribe) {
+        *mask |= bit;
+        topic_sub_count[slot]++;
+    } else {
+        *mask &= ~bit;
+        topic_sub_count[slot]--;
+        topic_prune(&topic_root);
+    }
+    topic_generation++;
+    return 0;
+}
+
+static void topic_clear_slot_walk(TopicNode* node, uint64_t bit) {
+    node->exact &= ~bit;
+    node->globstar &= ~bit;
+    for (TopicNode* c = node->child; c; c = c->sibling) topic_clear_slot_walk(c, bit);
+}
+
+/**
+ * @brief ลบทุก Subscription ของ Slot (เรียกจาก remove_client ภายใต้ WRITE Lock)
+ */
+void topic_remove_slot(int slot) {
+    if (topic_sub_count[slot] == 0) return;
+    topic_clear_slot_walk(&topic_root, 1ULL << slot);
+    topic_prune(&topic_root);
+    topic_sub_count[slot] = 0;
+    topic_generation++;
+}
+
+static uint64_t topic_match_walk(const TopicNode* node, char segs[][MAX_CHANNEL], int depth, int count) {
+    uint64_t mask = node->globstar; // "**" ตรงกับ 0 Segment ขึ้นไปที่เหลือ
+    if (depth == count) return mask | node->exact;
+
+    for (const TopicNode* c = node->child; c; c = c->sibling) {
+        if (strcmp(c->segment, segs[depth]) == 0 || strcmp(c->segment, "*") == 0) {
+            mask |= topic_match_walk(c, segs, depth + 1, count);
+        }
+    }
+    return mask;
+}
+
+static TopicCacheEntry* topic_cache_entry(const char* topic) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const char* p = topic; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    return &topic_cache[h % TOPIC_CACHE_SIZE];
+}
+
+/**
+ * @brief อ่านผล Match ที่ Cache ไว้ของ Topic (ไม่ต้องถือ Registry Lock)
+ * @details ไม่ได้ตรวจว่า Cache หมดอายุหรือยัง ผู้เรียกต้องเทียบ generation กับ topic_generation เอง
+ * (handle_pub เทียบใน Seqlock Snapshot)
+ * @return 1 หากมี Entry ของ Topic นี้
+ */
+static int topic_cache_get(const char* topic, uint64_t* mask, unsigned* generation) {
+    TopicCacheEntry* entry = topic_cache_entry(topic);
+    pthread_mutex_lock(&topic_cache_mutex);
+    int found = strcmp(entry->topic, topic) == 0;
+    if (found) {
+        *mask = entry->mask;
+        *generation = entry->generation;
+    }
+    pthread_mutex_unlock(&topic_cache_mutex);
+    return found;
+}
+
+/**
+ * @brief หา Slot ของทุก Client ที่ Subscribe Pattern ที่ตรงกับ Topic (ต้องเรียกภายใต้ READ Lock)
+ * @details เดิน Trie เฉพาะกิ่งที่ตรงกับ Segment ของ Topic (หรือ "*") ไม่ต้องไล่ทุก Subscription
+ * และเก็บผลไว้ใน Cache จนกว่า Subscription จะเปลี่ยน
+ */
+static uint64_t topic_match(const char* topic, char segs[][MAX_CHANNEL], int count) {
+    uint64_t mask;
+    unsigned generation;
+    if (topic_cache_get(topic, &mask, &generation) && generation == topic_generation) {
+        atomic_fetch_add_explicit(&topic_cache_hits, 1, memory_order_relaxed);
+        return mask;
+    }
+
+    mask = topic_match_walk(&topic_root, segs, 0, count);
+    atomic_fetch_add_explicit(&topic_cache_misses, 1, memory_order_relaxed);
+
+    TopicCacheEntry* entry = topic_cache_entry(topic);
+    pthread_mutex_lock(&topic_cache_mutex);
+    snprintf(entry->topic, sizeof(entry->topic), "%s", topic);
+    entry->mask = mask;
+    entry->generation = topic_generation;
+    pthread_mutex_unlock(&topic_cache_mutex);
+    return mask;
+}
+
+// --- Admission Control (Per-client Token Bucket) ---
+
+/**
+ * @brief รีเซ็ต Token Bucket ของ Slot ให้เต็ม (เรียกตอน CMD_REGISTER)
+ */
+static void rate_limit_reset(int slot) {
+    RateLimitSlot* rl = &rate_limits[slot];
+    int64_t now = now_ns();
+    atomic_store_explicit(&rl->msg.tokens_milli, (int64_t)config.msg_burst * 1000, memory_order_relaxed);
+    atomic_store_explicit(&rl->msg.last_refill_ns, now, memory_order_relaxed);
+    atomic_store_explicit(&rl->ctrl.tokens_milli, (int64_t)config.ctrl_burst * 1000, memory_order_relaxed);
+    atomic_store_explicit(&rl->ctrl.last_refill_ns, now, memory_order_relaxed);
+    atomic_store_explicit(&rl->throttled_total, 0, memory_order_relaxed);
+    atomic_store_explicit(&rl->throttled_window, 0, memory_order_relaxed);
+}
+
+/**
+ * @brief หัก Token 1 หน่วยจาก Bucket
+ * @details Router เป็นผู้เขียน Bucket เพียงคนเดียว ส่วน Monitor อ่านอย่างเดียว จึงใช้ Atomic แบบ relaxed ได้โดยไม่ต้องใช้ Lock
+ * @param allow_debt อนุญาตให้ Token ติดลบ (โหมด delay) ไม่เกิน max_delay_ms
+ * @param wait_ns [out] เวลาที่ต้องรอก่อนคำสั่งนี้จะถูกประมวลผล (0 = ทำได้ทันที)
+ * @return 1 หากผ่าน (ทันทีหรือแบบหน่วง), 0 หากต้องถูกจำกัด
+ */
+static int bucket_take(TokenBucket* b, int rate, int burst, int allow_debt, int64_t* wait_ns) {
+    int64_t now = now_ns();
+    int64_t tokens = atomic_load_explicit(&b->tokens_milli, memory_order_relaxed);
+    int64_t last = atomic_load_explicit(&b->last_refill_ns, memory_order_relaxed);
+    int64_t capacity = (int64_t)burst * 1000;
+
+    // เติม Token ตามเวลาที่ผ่านไป (rate token/วินาที = rate milli-token ต่อ 1 ms)
+    int64_t elapsed = now - last;
+    if (elapsed > 60LL * 1000000000LL) elapsed = 60LL * 1000000000LL; // กัน overflow
+    int64_t refill = elapsed * rate / 1000000;
+    if (refill > 0) {
+        tokens += refill;
+        if (tokens >= capacity || elapsed < now - last) {
+            // Bucket เต็ม (หรือว่างนานเกิน 60 วินาที): เศษเวลาที่เหลือไม่มีผลแล้ว
+            if (tokens > capacity) tokens = capacity;
+            last = now;
+        } else {
+            // เลื่อนเฉพาะเวลาที่ Token ที่เติมใช้ไป เศษที่ยังไม่ครบ 1 milli-token ยกไปรอบหน้า (ไม่ทิ้ง)
+            last += refill * 1000000 / rate;
+        }
+        atomic_store_explicit(&b->last_refill_ns, last, memory_order_relaxed);
+    }
+
+    *wait_ns = 0;
+    if (tokens >= 1000) {
+        tokens -= 1000;
+    } else if (allow_debt && rate > 0 &&
+               (1000 - tokens) * 1000000 / rate <= (int64_t)config.max_delay_ms * 1000000) {
+        tokens -= 1000;
+        *wait_ns = (-tokens) * 1000000 / rate; // เวลาที่ต้องใช้ในการจ่ายหนี้คืน
+    } else {
+        atomic_store_explicit(&b->tokens_milli, tokens, memory_order_relaxed);
+        return 0;
+    }
+    atomic_store_explicit(&b->tokens_milli, tokens, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * @brief เพิ่มคำสั่งเข้า Delayed Command Queue (เรียงตามเวลา)
+ */
+static void defer_command(const CommandMessage* cmd, int64_t ready_ns) {
+    DelayedCommand* dc = (DelayedCommand*)malloc(sizeof(DelayedCommand));
+    dc->ready_ns = ready_ns;
+    dc->cmd = *cmd;
+
+    pthread_mutex_lock(&delay_mutex);
+    DelayedCommand** pp = &delay_queue_head;
+    while (*pp && (*pp)->ready_ns <= ready_ns) pp = &(*pp)->next; // คงลำดับของ Client เดียวกัน
+    dc->next = *pp;
+    *pp = dc;
+    pthread_cond_signal(&delay_cond);
+    pthread_mutex_unlock(&delay_mutex);
+}
+
+/**
+ * @brief ตัดการเชื่อมต่อ Client ที่ส่งคำสั่งเกินกำหนด (โหมด THROTTLE_KICK)
+ */
+static void kick_flooder(const CommandMessage* cmd) {
+    registry_write_lock();
+    if (find_client_index(cmd_session(cmd)) != -1) {
+        printf("Router: Kicking client %ld for exceeding rate limit.\n", cmd_session(cmd));
+
+        Job* kick_job = (Job*)malloc(sizeof(Job));
+        kick_job->type = CMD_DM;
+        kick_job->target_qid = cmd->reply_qid;
+        kick_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(kick_job->sender_name, "SERVER");
+        strcpy(kick_job->message, "You have been disconnected for exceeding the rate limit.");
+        add_job(kick_job);
+
+        remove_client(cmd_session(cmd));
+    }
+    registry_write_unlock();
+}
+
+/**
+ * @brief ตรวจสอบ Rate Limit ของคำสั่งก่อน Dispatch (เรียกจาก Router เท่านั้น)
+ * @details CMD_QUIT ไม่ถูกจำกัดเสมอ ส่วน CMD_REGISTER ถูกเรียกที่นี่เฉพาะเมื่อ Session ลงทะเบียนแล้ว (REGISTER ซ้ำ)
+ * ซึ่งถูกปฏิเสธแต่ยังต้องใช้ WRITE Lock และส่งข้อความตอบกลับ จึงนับเป็นคำสั่งควบคุม
+ * @return 1 หาก Router ควร Dispatch คำสั่งทันที, 0 หากคำสั่งถูก drop/delay/kick ไปแล้ว
+ */
+int admit_command(int client_idx, const CommandMessage* cmd) {
+    RateLimitSlot* rl = &rate_limits[client_idx];
+    TokenBucket* bucket;
+    int rate, burst;
+
+    switch (cmd->command) {
+        case CMD_MSG:
+        case CMD_DM:
+        case CMD_PUB:
+        case CMD_MULTICAST:
+        case CMD_ANNOUNCE:
+            bucket = &rl->msg; rate = config.msg_rate; burst = config.msg_burst;
+            break;
+        case CMD_JOIN:
+        case CMD_WHO:
+        case CMD_LEAVE:
+        case CMD_SUB:
+        case CMD_UNSUB:
+        case CMD_NICK:
+        case CMD_REGISTER:
+            bucket = &rl->ctrl; rate = config.ctrl_rate; burst = config.ctrl_burst;
+            break;
+        default:
+            return 1;
+    }
+
+    int64_t wait_ns;
+    if (bucket_take(bucket, rate, burst, config.throttle_action == THROTTLE_DELAY, &wait_ns)) {
+        if (wait_ns == 0) return 1;
+        defer_command(cmd, now_ns() + wait_ns);
+        atomic_fetch_add_explicit(&rl->throttled_total, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&rl->throttled_window, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    // ถูกจำกัด: แจ้ง Client เฉพาะครั้งแรกของแต่ละช่วงรายงาน เพื่อไม่ให้การแจ้งเตือนกลายเป็นการขยายโหลดเสียเอง
+    uint64_t prev = atomic_fetch_add_explicit(&rl->throttled_window, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&rl->throttled_total, 1, memory_order_relaxed);
+
+    if (config.throttle_action == THROTTLE_KICK) {
+        kick_flooder(cmd);
+    } else if (prev == 0) {
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(error_job->sender_name, "SERVER");
+        strcpy(error_job->message, "Error: Rate limit exceeded. Command dropped.");
+        add_job(error_job);
+    }
+    return 0;
+}
+
+/**
+ * @brief Thread สำหรับปล่อยคำสั่งที่ถูกหน่วง (THROTTLE_DELAY) เมื่อถึงเวลา
+ * @details แยกจาก Router เพื่อไม่ให้การหน่วง Client คนหนึ่งบล็อกคำสั่งของ Client อื่น
+ */
+void* delay_thread(void* arg) {
+    pthread_mutex_lock(&delay_mutex);
+    while (1) {
+        if (delay_queue_head == NULL) {
+            pthread_cond_wait(&delay_cond, &delay_mutex);
+            continue;
+        }
+        int64_t ready = delay_queue_head->ready_ns;
+        if (now_ns() < ready) {
+            struct timespec ts = { ready / 1000000000LL, ready % 1000000000LL };
+            pthread_cond_timedwait(&delay_cond, &delay_mutex, &ts);
+            continue;
+        }
+
+        DelayedCommand* dc = delay_queue_head;
+        delay_queue_head = dc->next;
+        pthread_mutex_unlock(&delay_mutex);
+
+        dispatch_command(&dc->cmd);
+        free(dc);
+
+        pthread_mutex_lock(&delay_mutex);
+    }
+    return NULL;
 }
 
 
@@ -270,62 +1816,99 @@ void remove_client(pid_t pid) {
 
 void handle_register(const CommandMessage* cmd) {
     // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Client Registry
-    pthread_rwlock_wrlock(&registry.rwlock);
+    registry_write_lock();
     
+    // Logical Session ต้องอยู่ในช่วงของ Gateway (ไม่ชนกับ PID และ mtype ของ Priority Lane),
+    // ต้องเป็นของ Process ที่ส่งคำสั่งมา และต้องไม่ซ้ำกับ Session ที่มีอยู่
+    const char* reject = NULL;
+    if (cmd->session_id != 0 && (!(cmd->session_id & SESSION_ID_GATEWAY_BIT) || cmd->session_id % SESSION_ID_STRIDE == 0 ||
+                                 SESSION_ID_OWNER(cmd->session_id) != cmd->sender_pid)) {
+        reject = "Error: Invalid session ID. Connection rejected.";
+    } else if (find_client_index(cmd_session(cmd)) != -1) {
+        reject = "Error: Session ID already registered. Connection rejected.";
+    }
+    if (reject) {
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd->session_id > MSG_TYPE_BROADCAST ? cmd->session_id : 0;
+        strcpy(error_job->sender_name, "SERVER");
+        strcpy(error_job->message, reject);
+        add_job(error_job);
+        registry_write_unlock();
+        return;
+    }
+
     int slot = find_client_index(0); // หา Slot ว่าง
     if (slot == -1) {
         // Server เต็ม, ส่ง error
         Job* error_job = (Job*)malloc(sizeof(Job));
         error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
         strcpy(error_job->sender_name, "SERVER");
         strcpy(error_job->message, "Error: Server is full. Connection rejected.");
         add_job(error_job);
-        pthread_rwlock_unlock(&registry.rwlock);
+        registry_write_unlock();
         return;
     }
 
     // ลงทะเบียน Client
+    registry.clients[slot].session_id = cmd_session(cmd);
     registry.clients[slot].pid = cmd->sender_pid;
     registry.clients[slot].reply_qid = cmd->reply_qid;
+    registry.clients[slot].reply_mtype = cmd_reply_mtype(cmd);
     strcpy(registry.clients[slot].current_channel, "");
     registry.clients[slot].last_active = time(NULL); // กำหนดเวลา Active
+    client_render_names(slot);
     registry.client_count++;
+    rate_limit_reset(slot);
+    atomic_store_explicit(&client_health[slot].dead, 0, memory_order_relaxed);
     
-    printf("Router: Client %d registered (QID: %d). Client Count: %d\n", cmd->sender_pid, cmd->reply_qid, registry.client_count);
+    printf("Router: Client %ld registered (PID: %d, QID: %d). Client Count: %d\n",
+           cmd_session(cmd), cmd->sender_pid, cmd->reply_qid, registry.client_count);
 
-    // ส่ง welcome message
+    // ตกลงความจุ Reply Queue: Client ขอมาใน target (ว่าง = ค่าแนะนำของ Server), จำกัดไม่เกิน reply_queue_max_msgs
+    int capacity = atoi(cmd->target);
+    if (capacity <= 0) capacity = config.reply_queue_default_msgs;
+    if (capacity > config.reply_queue_max_msgs) capacity = config.reply_queue_max_msgs;
+    if (capacity < MIN_QUEUE_MSGS) capacity = MIN_QUEUE_MSGS;
+
+    // ส่ง welcome message (ความจุที่ตกลงแล้วอยู่ใน queue_capacity ให้ Client นำไปตั้ง Reply Queue ของตัวเอง)
     Job* welcome_job = (Job*)malloc(sizeof(Job));
-    welcome_job->type = CMD_DM; 
+    welcome_job->type = CMD_REGISTER;
+    welcome_job->queue_capacity = capacity;
     welcome_job->target_qid = cmd->reply_qid;
+    welcome_job->target_mtype = cmd_reply_mtype(cmd);
     strcpy(welcome_job->sender_name, "SERVER");
-    sprintf(welcome_job->message, "Welcome User %d! Use JOIN <#channel> or WHO <#channel>.", cmd->sender_pid);
+    sprintf(welcome_job->message, "Welcome User %ld! Use JOIN <#channel> or WHO <#channel>. " REPLY_QUEUE_HINT "%d msgs offered",
+            cmd_session(cmd), capacity);
     add_job(welcome_job);
     
-    pthread_rwlock_unlock(&registry.rwlock);
+    registry_write_unlock();
 }
 
 void handle_quit(const CommandMessage* cmd) {
     // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Client/Room Registry
-    pthread_rwlock_wrlock(&registry.rwlock);
-    remove_client(cmd->sender_pid);
+    registry_write_lock();
+    remove_client(cmd_session(cmd));
     
     // ส่งยืนยันการออกก่อนที่จะจบ (แม้ client จะปิดตัวทันที)
     Job* confirm_job = (Job*)malloc(sizeof(Job));
     confirm_job->type = CMD_DM; 
     confirm_job->target_qid = cmd->reply_qid;
+    confirm_job->target_mtype = cmd_reply_mtype(cmd);
     strcpy(confirm_job->sender_name, "SERVER");
     sprintf(confirm_job->message, "You have been disconnected. Goodbye.");
     add_job(confirm_job);
     
-    pthread_rwlock_unlock(&registry.rwlock);
+    registry_write_unlock();
 }
 
 void handle_join(const CommandMessage* cmd) {
     // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Client/Room Registry
-    pthread_rwlock_wrlock(&registry.rwlock);
+    registry_write_lock();
     
-    int client_idx = find_client_index(cmd->sender_pid);
-    if (client_idx == -1) { pthread_rwlock_unlock(&registry.rwlock); return; }
+    int client_idx = find_client_index(cmd_session(cmd));
+    if (client_idx == -1) { registry_write_unlock(); return; }
 
     char old_channel[MAX_CHANNEL];
     strcpy(old_channel, registry.clients[client_idx].current_channel);
@@ -340,15 +1923,16 @@ void handle_join(const CommandMessage* cmd) {
             strcpy(registry.rooms[new_room_idx].channel_name, cmd->channel);
             registry.rooms[new_room_idx].member_count = 0; 
             registry.room_count++;
-            printf("Router: New channel %s created by %d.\n", cmd->channel, cmd->sender_pid);
+            printf("Router: New channel %s created by %ld.\n", cmd->channel, cmd_session(cmd));
         } else {
             // ไม่สามารถสร้างห้องได้
             Job* error_job = (Job*)malloc(sizeof(Job));
             error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+            error_job->target_mtype = cmd_reply_mtype(cmd);
             strcpy(error_job->sender_name, "SERVER");
             strcpy(error_job->message, "Error: Cannot join/create channel, room limit reached.");
             add_job(error_job);
-            pthread_rwlock_unlock(&registry.rwlock);
+            registry_write_unlock();
             return;
         }
     }
@@ -357,299 +1941,1534 @@ void handle_join(const CommandMessage* cmd) {
     if (old_channel[0] != '\0' && strcmp(old_channel, cmd->channel) != 0) {
         int old_room_idx = find_room_index(old_channel);
         if (old_room_idx != -1) {
-            remove_client_from_room(old_room_idx, cmd->sender_pid);
+            remove_client_from_room(old_room_idx, cmd_session(cmd));
             
-            // Broadcast แจ้งการออก
-            Job* leave_job = (Job*)malloc(sizeof(Job));
-            leave_job->type = CMD_MSG;
-            strcpy(leave_job->sender_name, "SERVER");
-            strcpy(leave_job->target_channel, old_channel);
-            sprintf(leave_job->message, "User %d left the channel (Joined %s).", cmd->sender_pid, cmd->channel);
-            add_job(leave_job);
+            // แจ้งการออก (รวมเป็น Presence Digest)
+            presence_event(old_channel, registry.clients[client_idx].label, 0);
         }
     }
 
     // 3. เข้าร่วม Channel ใหม่
-    add_client_to_room(new_room_idx, cmd->sender_pid);
+    add_client_to_room(new_room_idx, cmd_session(cmd));
     strcpy(registry.clients[client_idx].current_channel, cmd->channel);
+    client_render_names(client_idx);
 
     // 4. ส่งยืนยันและ Broadcast การเข้าร่วม
     Job* confirm_job = (Job*)malloc(sizeof(Job));
     confirm_job->type = CMD_DM; 
     confirm_job->target_qid = cmd->reply_qid;
+    confirm_job->target_mtype = cmd_reply_mtype(cmd);
     strcpy(confirm_job->sender_name, "SERVER");
     sprintf(confirm_job->message, "You have joined %s. Total members: %d", cmd->channel, registry.rooms[new_room_idx].member_count);
     add_job(confirm_job);
 
-    // *** System Event: "Alice joined" ***
-    Job* join_job = (Job*)malloc(sizeof(Job));
-    join_job->type = CMD_MSG;
-    strcpy(join_job->sender_name, "SERVER");
-    strcpy(join_job->target_channel, cmd->channel);
-    sprintf(join_job->message, "User %d has joined the channel.", cmd->sender_pid);
-    add_job(join_job);
+    // *** System Event: "Alice joined" (รวมเป็น Presence Digest) ***
+    presence_event(cmd->channel, registry.clients[client_idx].label, 1);
     
-    pthread_rwlock_unlock(&registry.rwlock);
+    registry_write_unlock();
 }
 
 void handle_msg(const CommandMessage* cmd) {
-    // ต้องใช้ READ Lock เพราะแค่ตรวจสอบสถานะ Channel และส่ง Job
-    pthread_rwlock_rdlock(&registry.rwlock);
-    
-    int client_idx = find_client_index(cmd->sender_pid);
-    if (client_idx == -1) { pthread_rwlock_unlock(&registry.rwlock); return; }
+    // อ่านแค่ Channel ปัจจุบันของผู้ส่ง: ใช้ Seqlock แทน READ Lock
+    ClientLookup sender = { .session = cmd_session(cmd) };
+    registry_read(copy_client_lookup, &sender);
+    if (sender.idx == -1) return;
 
-    const char* current_channel = registry.clients[client_idx].current_channel;
-    if (current_channel[0] == '\0') {
+    if (sender.channel[0] == '\0') {
         Job* error_job = (Job*)malloc(sizeof(Job));
         error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
         strcpy(error_job->sender_name, "SERVER");
         strcpy(error_job->message, "Error: You are not in a channel. Use JOIN <#channel>.");
         add_job(error_job);
-        pthread_rwlock_unlock(&registry.rwlock);
         return;
     }
 
     // สร้างและเพิ่ม Broadcast Job
     Job* msg_job = (Job*)malloc(sizeof(Job));
     msg_job->type = CMD_MSG;
-    sprintf(msg_job->sender_name, "[%s] User %d", current_channel, cmd->sender_pid);
-    strcpy(msg_job->target_channel, current_channel);
+    memcpy(msg_job->sender_name, sender.prefix, MAX_USERNAME); // Render ไว้แล้วตอน JOIN/NICK
+    strcpy(msg_job->target_channel, sender.channel);
     strncpy(msg_job->message, cmd->text, MAX_TEXT_SIZE);
     add_job(msg_job);
+}
 
-    pthread_rwlock_unlock(&registry.rwlock);
+void handle_dm(const CommandMessage* cmd) {
+    // อ่านแค่ Endpoint ของผู้รับ: ใช้ Seqlock แทน READ Lock
+    // แปลง Target string เป็น Session ID (Client ปกติ = PID)
+    // ขึ้นต้นด้วยตัวอักษร = ชื่อเล่น (ค้นหาใน Directory แบบ O(1)), ตัวเลข = Session ID (Client ปกติ = PID)
+    int by_nick = isalpha((unsigned char)cmd->target[0]);
+    DmLookup dm = { .sender = cmd_session(cmd), .target = by_nick ? 0 : strtol(cmd->target, NULL, 10),
+                    .target_nick = by_nick ? cmd->target : NULL };
+    registry_read(copy_dm_lookup, &dm);
+    if (dm.sender_idx == -1) return;
+
+    if (dm.target_idx == -1) {
+        // ผู้รับไม่ออนไลน์: เก็บลง Offline Mailbox (ถ้าเปิดใช้และเคยมีคนใช้ชื่อนี้) แล้วแจ้งผลกลับไปหาผู้ส่ง
+        // PID/Session ID ถูกใช้ซ้ำได้ จึงเก็บเข้าชื่อเล่นล่าสุดของ Session นั้นแทน (ชื่อถูกจองด้วย Key ของเจ้าของ)
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(error_job->sender_name, "SERVER");
+        char recipient[NICK_MAX_LEN + 1] = "";
+        if (mailbox_enabled && by_nick && strnlen(cmd->target, MAX_USERNAME) <= NICK_MAX_LEN) {
+            strcpy(recipient, cmd->target);
+        } else if (mailbox_enabled && !by_nick && dm.target > 0) {
+            mailbox_nick_of(dm.target, recipient);
+        }
+        int pending = 0;
+        if (recipient[0] != '\0') {
+            char sender[NICK_MAX_LEN + 1];
+            if (dm.sender_nick[0] != '\0') {
+                strcpy(sender, dm.sender_nick);
+            } else {
+                snprintf(sender, sizeof(sender), "%ld", cmd_session(cmd));
+            }
+            pending = mailbox_store(recipient, sender, cmd->text);
+        }
+        if (pending > 0) {
+            if (by_nick) {
+                sprintf(error_job->message, "User %s is offline. Message stored in mailbox (%d pending).", recipient, pending);
+            } else {
+                sprintf(error_job->message, "User %ld is offline. Message stored in the mailbox of %s, the last nickname it used (%d pending).",
+                        dm.target, recipient, pending);
+            }
+            // ไม่ได้ถือ Lock: ผู้รับอาจตั้งชื่อนี้ระหว่างนี้และ Flush ไปก่อนที่จดหมายนี้จะถูกเก็บ
+            dm.target_nick = recipient;
+            registry_read(copy_dm_lookup, &dm);
+            if (dm.target_idx != -1) mailbox_request_flush(recipient);
+        } else if (pending == -1) {
+            sprintf(error_job->message, "Error: Mailbox of user %s is full. Message dropped.", recipient);
+        } else if (!by_nick && mailbox_enabled) {
+            sprintf(error_job->message, "Error: User PID %.*s is not online and never set a nickname, so there is no mailbox for it.", MAX_USERNAME, cmd->target);
+        } else if (!by_nick) {
+            sprintf(error_job->message, "Error: User PID %.*s is not online.", MAX_USERNAME, cmd->target);
+        } else if (mailbox_enabled) {
+            sprintf(error_job->message, "Error: User %.*s is not online, and nobody has used that nickname yet (no mailbox).", MAX_USERNAME, cmd->target);
+        } else {
+            sprintf(error_job->message, "Error: User %.*s is not online.", MAX_USERNAME, cmd->target);
+        }
+        add_job(error_job);
+        return;
+    }
+
+    // 1. Job สำหรับ Target (DM)
+    Job* target_job = (Job*)malloc(sizeof(Job));
+    target_job->type = CMD_DM;
+    target_job->target_qid = dm.target_qid;
+    target_job->target_mtype = dm.target_mtype;
+    // ใช้ชื่อเล่นถ้ามี เพื่อให้ผู้รับตอบกลับด้วย DM <ชื่อ> ได้ทันที
+    if (dm.sender_nick[0] != '\0') {
+        sprintf(target_job->sender_name, "(DM from %s)", dm.sender_nick);
+    } else {
+        sprintf(target_job->sender_name, "(DM from %ld)", cmd_session(cmd));
+    }
+    strncpy(target_job->message, cmd->text, MAX_TEXT_SIZE);
+    add_job(target_job);
+    
+    // 2. Confirmation Job สำหรับผู้ส่ง
+    Job* confirm_job = (Job*)malloc(sizeof(Job));
+    confirm_job->type = CMD_DM;
+    confirm_job->target_qid = cmd->reply_qid;
+    confirm_job->target_mtype = cmd_reply_mtype(cmd);
+    strcpy(confirm_job->sender_name, "SERVER");
+    sprintf(confirm_job->message, "DM sent to %.*s.", MAX_USERNAME, cmd->target);
+    add_job(confirm_job);
+}
+
+void handle_who(const CommandMessage* cmd) {
+    // คัดลอกรายชื่อสมาชิกผ่าน Seqlock แล้วค่อยจัดรูปแบบข้อความนอกช่วงอ่าน
+    WhoLookup who = { .session = cmd_session(cmd), .channel = cmd->channel };
+    registry_read(copy_who_lookup, &who);
+    if (who.client_idx == -1) return;
+
+    Job* reply_job = (Job*)malloc(sizeof(Job));
+    reply_job->type = CMD_WHO; 
+    reply_job->target_qid = cmd->reply_qid;
+    reply_job->target_mtype = cmd_reply_mtype(cmd);
+    strcpy(reply_job->sender_name, "SERVER");
+
+    if (who.room_idx == -1) {
+        sprintf(reply_job->message, "Error: Channel %s does not exist.", cmd->channel);
+    } else {
+        char buffer[MAX_TEXT_SIZE];
+        char* ptr = buffer;
+        int remaining = MAX_TEXT_SIZE;
+        
+        int written = snprintf(ptr, remaining, "Members of %s (%d): ", cmd->channel, who.member_count);
+        ptr += written; remaining -= written;
+
+        for (int i = 0; i < who.member_count; i++) {
+            const char* sep = i < who.member_count - 1 ? ", " : "";
+            if (who.nicks[i][0] != '\0') {
+                written = snprintf(ptr, remaining, "%s (%ld)%s", who.nicks[i], who.members[i], sep);
+            } else {
+                written = snprintf(ptr, remaining, "%ld%s", who.members[i], sep);
+            }
+            ptr += written; remaining -= written;
+            if (remaining <= 1) break; 
+        }
+        strncpy(reply_job->message, buffer, MAX_TEXT_SIZE);
+    }
+    add_job(reply_job);
+}
+
+void handle_leave(const CommandMessage* cmd) {
+    // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Client/Room Registry
+    registry_write_lock();
+
+    int client_idx = find_client_index(cmd_session(cmd));
+    if (client_idx == -1) { registry_write_unlock(); return; }
+
+    char old_channel[MAX_CHANNEL];
+    strcpy(old_channel, registry.clients[client_idx].current_channel);
+    
+    if (old_channel[0] == '\0') {
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(error_job->sender_name, "SERVER");
+        strcpy(error_job->message, "Error: You are not currently in any channel.");
+        add_job(error_job);
+        registry_write_unlock();
+        return;
+    }
+
+    // 1. ลบ Client ออกจาก Room Registry
+    int room_idx = find_room_index(old_channel);
+    if (room_idx != -1) {
+        remove_client_from_room(room_idx, cmd_session(cmd));
+        
+        // แจ้งการออก (รวมเป็น Presence Digest)
+        presence_event(old_channel, registry.clients[client_idx].label, 0);
+    }
+
+    // 2. ล้างสถานะ Channel ของ Client
+    strcpy(registry.clients[client_idx].current_channel, "");
+    client_render_names(client_idx);
+
+    // 3. ส่งยืนยัน
+    Job* confirm_job = (Job*)malloc(sizeof(Job));
+    confirm_job->type = CMD_DM; 
+    confirm_job->target_qid = cmd->reply_qid;
+    confirm_job->target_mtype = cmd_reply_mtype(cmd);
+    strcpy(confirm_job->sender_name, "SERVER");
+    sprintf(confirm_job->message, "You have left %s.", old_channel);
+    add_job(confirm_job);
+
+    registry_write_unlock();
+}
+
+void handle_sub(const CommandMessage* cmd) {
+    // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Topic Trie
+    registry_write_lock();
+
+    int client_idx = find_client_index(cmd_session(cmd));
+    if (client_idx == -1) { registry_write_unlock(); return; }
+
+    char pattern[MAX_CHANNEL];
+    snprintf(pattern, sizeof(pattern), "%.*s", MAX_CHANNEL - 1, cmd->channel);
+    int subscribe = cmd->command == CMD_SUB;
+
+    Job* reply_job = (Job*)malloc(sizeof(Job));
+    reply_job->type = CMD_DM;
+    reply_job->target_qid = cmd->reply_qid;
+    reply_job->target_mtype = cmd_reply_mtype(cmd);
+    strcpy(reply_job->sender_name, "SERVER");
+
+    if (subscribe && topic_sub_count[client_idx] >= MAX_SUBSCRIPTIONS) {
+        sprintf(reply_job->message, "Error: Subscription limit (%d) reached.", MAX_SUBSCRIPTIONS);
+    } else {
+        int rc = topic_subscribe(pattern, client_idx, subscribe);
+        if (rc == -1) {
+            sprintf(reply_job->message, "Error: Invalid topic pattern %s (use #a.b, #a.*, #a.**) or topic limit reached.", pattern);
+        } else if (rc == 1) {
+            sprintf(reply_job->message, subscribe ? "Already subscribed to %s." : "Not subscribed to %s.", pattern);
+        } else {
+            sprintf(reply_job->message, "%s %s (%d active).", subscribe ? "Subscribed to" : "Unsubscribed from",
+                    pattern, topic_sub_count[client_idx]);
+        }
+    }
+    add_job(reply_job);
+
+    registry_write_unlock();
+}
+
+void handle_multicast(const CommandMessage* cmd) {
+    // อ่านสมาชิกของห้องและ QID ของผู้รับอย่างเดียว: ใช้ Seqlock แทน READ Lock
+    MulticastLookup cast = { .session = cmd_session(cmd), .command = cmd->command };
+    char channels[MAX_CHANNEL_LIST];
+    int too_long = cmd->command == CMD_MULTICAST && strnlen(cmd->channels, MAX_CHANNEL_LIST) == MAX_CHANNEL_LIST;
+    snprintf(channels, sizeof(channels), "%s", too_long ? "" : cmd->channels);
+    cast.channels = channels;
+    registry_read(copy_multicast_lookup, &cast);
+    if (cast.client_idx == -1) return;
+
+    // ANNOUNCE ส่งถึงทุกคน: อนุญาตเฉพาะ Client ที่ใช้ชื่อ Admin (ชื่อถูกจองด้วย Key จึงปลอมตัวไม่ได้)
+    if (cmd->command == CMD_ANNOUNCE && (config.admin_nick[0] == '\0' || strcmp(cast.nick, config.admin_nick) != 0)) {
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(error_job->sender_name, "SERVER");
+        strcpy(error_job->message, config.admin_nick[0] == '\0' ? "Error: ANNOUNCE is disabled on this server." :
+                                   "Error: ANNOUNCE is restricted to the server admin.");
+        add_job(error_job);
+        return;
+    }
+
+    // รายชื่อห้องต้องจบด้วย '\0' ภายใน channels (Client ส่งเกินมา = ถูกตัด) ไม่ส่งไปบางส่วนแบบเงียบๆ
+    if (too_long) {
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(error_job->sender_name, "SERVER");
+        sprintf(error_job->message, "Error: Channel list is too long (max %d characters). Nothing was sent.", MAX_CHANNEL_LIST - 1);
+        add_job(error_job);
+        return;
+    }
+
+    // 1. ผู้รับถูกตัดซ้ำและ Resolve เป็น QID/mtype แล้วใน Snapshot ส่งเป็นงาน Fan-out เดียว (Broadcaster สร้าง Frame ครั้งเดียว)
+    Job* cast_job = (Job*)malloc(sizeof(Job));
+    cast_job->type = cmd->command;
+    cast_job->target_count = cast.target_count;
+    memcpy(cast_job->targets, cast.targets, cast.target_count * sizeof(JobTarget));
+    // Tag คงที่แทนรายชื่อห้อง (รายชื่อยาวจะถูกตัดจนอ่านไม่ออก) ชื่อผู้ส่งจึงครบเสมอ
+    render_sender_name(cast_job->sender_name, cmd->command == CMD_ANNOUNCE ? "ANNOUNCE" : "multicast", cast.label);
+    strncpy(cast_job->message, cmd->text, MAX_TEXT_SIZE);
+
+    // 2. แจ้งผลให้ผู้ส่ง (งานด่วน ไม่ต้องรอ Fan-out)
+    Job* confirm_job = (Job*)malloc(sizeof(Job));
+    confirm_job->type = CMD_DM;
+    confirm_job->target_qid = cmd->reply_qid;
+    confirm_job->target_mtype = cmd_reply_mtype(cmd);
+    strcpy(confirm_job->sender_name, "SERVER");
+    if (cmd->command == CMD_ANNOUNCE) {
+        sprintf(confirm_job->message, "Announcement sent to %d clients.", cast_job->target_count);
+    } else {
+        sprintf(confirm_job->message, "Multicast sent to %d unique recipients in %d channel(s)%s.",
+                cast_job->target_count, cast.rooms, cast.unknown ? ", unknown channels skipped" : "");
+    }
+
+    if (cast_job->target_count > 0) {
+        add_job(cast_job);
+    } else {
+        free(cast_job);
+    }
+    add_job(confirm_job);
+}
+
+void handle_nick(const CommandMessage* cmd) {
+    // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Nickname Directory และชื่อที่ Render ไว้
+    registry_write_lock();
+
+    int client_idx = find_client_index(cmd_session(cmd));
+    if (client_idx == -1) { registry_write_unlock(); return; }
+
+    char nick[MAX_USERNAME];
+    snprintf(nick, sizeof(nick), "%.*s", MAX_USERNAME - 1, cmd->target);
+    int owner = nick_valid(nick) ? nick_lookup(nick) : -1;
+
+    Job* reply_job = (Job*)malloc(sizeof(Job));
+    reply_job->type = CMD_DM;
+    reply_job->target_qid = cmd->reply_qid;
+    reply_job->target_mtype = cmd_reply_mtype(cmd);
+    strcpy(reply_job->sender_name, "SERVER");
+
+    // ชื่อที่ถูกจองใน Mailbox ต้องแนบ Key ของเจ้าของมาด้วย (กันคนอื่นตั้งชื่อนี้เพื่ออ่านจดหมายที่ค้าง)
+    uint64_t key = 0;
+    int pending = 0;
+    if (nick_valid(nick) && owner == -1 && mailbox_enabled) {
+        char key_text[20];
+        snprintf(key_text, sizeof(key_text), "%.*s", (int)sizeof(key_text) - 1, cmd->text);
+        pending = mailbox_claim(nick, key_text, cmd_session(cmd), &key);
+    }
+
+    if (!nick_valid(nick)) {
+        sprintf(reply_job->message, "Error: Invalid nickname. Use 1-%d letters, digits, '_' or '-', starting with a letter.", NICK_MAX_LEN);
+    } else if (owner != -1 && owner != client_idx) {
+        sprintf(reply_job->message, "Error: Nickname %s is already taken.", nick);
+    } else if (pending == -2) {
+        sprintf(reply_job->message, "Error: Nickname %s is reserved. Use NICK %s <key> with the key you got when you first took it.", nick, nick);
+    } else {
+        // เปลี่ยนชื่อ: ลบชื่อเก่าออกจาก Directory ก่อน แล้วค่อยเพิ่มชื่อใหม่และ Render ชื่อที่แสดงใหม่
+        if (owner == -1) {
+            if (mailbox_enabled && registry.clients[client_idx].nick[0] != '\0') mailbox_seen(registry.clients[client_idx].nick);
+            nick_index_remove(client_idx);
+            strcpy(registry.clients[client_idx].nick, nick);
+            nick_index_add(client_idx);
+            client_render_names(client_idx);
+            printf("Router: Client %ld is now known as %s.\n", cmd_session(cmd), nick);
+
+            // ส่งจดหมายที่ค้างถึงชื่อนี้ (Mailbox Thread ทำต่อหลังจากนี้ ไม่บล็อก Router)
+            if (pending > 0) mailbox_request_flush(nick);
+        }
+        if (key != 0) {
+            sprintf(reply_job->message, "You are now known as %s. Key: %016llx (NICK %s <key> reclaims this name and its offline mail).",
+                    nick, (unsigned long long)key, nick);
+        } else {
+            sprintf(reply_job->message, "You are now known as %s. Others can DM %s <text>.", nick, nick);
+        }
+    }
+    add_job(reply_job);
+
+    registry_write_unlock();
+}
+
+void handle_pub(const CommandMessage* cmd) {
+    char topic[MAX_CHANNEL];
+    char segs[TOPIC_MAX_DEPTH][MAX_CHANNEL];
+    snprintf(topic, sizeof(topic), "%.*s", MAX_CHANNEL - 1, cmd->channel);
+    int count = topic_split(topic, segs, 0);
+
+    // Topic ที่เคย Publish แล้ว (Cache Hit) อ่านผู้รับผ่าน Seqlock โดยไม่ถือ READ Lock
+    PubLookup pub = { .session = cmd_session(cmd) };
+    int cached = count > 0 && topic_cache_get(topic, &pub.mask, &pub.generation);
+    registry_read(copy_pub_lookup, &pub);
+    if (pub.client_idx == -1) return;
+
+    if (count > 0 && cached && !pub.stale) {
+        atomic_fetch_add_explicit(&topic_cache_hits, 1, memory_order_relaxed);
+    } else if (count > 0) {
+        // Cache Miss: การเดิน Trie ต้องใช้ READ Lock เพราะ UNSUB/QUIT คืนหน่วยความจำของ Node ได้ระหว่างอ่าน
+        pthread_rwlock_rdlock(&registry.rwlock);
+        pub.mask = topic_match(topic, segs, count);
+        pub.generation = topic_generation;
+        copy_pub_lookup(&pub);
+        pthread_rwlock_unlock(&registry.rwlock);
+        if (pub.client_idx == -1) return;
+    }
+
+    if (count <= 0 || pub.mask == 0) {
+        Job* error_job = (Job*)malloc(sizeof(Job));
+        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
+        error_job->target_mtype = cmd_reply_mtype(cmd);
+        strcpy(error_job->sender_name, "SERVER");
+        if (count <= 0) {
+            sprintf(error_job->message, "Error: Invalid topic %s (no wildcards when publishing).", topic);
+        } else {
+            sprintf(error_job->message, "No subscribers for %s.", topic);
+        }
+        add_job(error_job);
+        return;
+    }
+
+    // ผู้รับถูก Resolve เป็น QID/mtype แล้วใน Snapshot (Broadcaster ไม่ต้องแตะ Registry)
+    Job* pub_job = (Job*)malloc(sizeof(Job));
+    pub_job->type = CMD_PUB;
+    pub_job->target_count = pub.target_count;
+    memcpy(pub_job->targets, pub.targets, pub.target_count * sizeof(JobTarget));
+    render_sender_name(pub_job->sender_name, topic, pub.label); // Topic ยาวถูกตัด แต่ชื่อผู้ส่งครบเสมอ
+    strncpy(pub_job->message, cmd->text, MAX_TEXT_SIZE);
+    add_job(pub_job);
+}
+
+// --- Traffic Capture (CHAT_CAPTURE=<trace file>) ---
+// Router แค่คัดลอก Record แบบย่อ (ตัด '\0' ที่ไม่ได้ใช้ออก) ลง Buffer ในหน่วยความจำ
+// การเขียนไฟล์ทั้งหมดทำโดย Capture Thread เพื่อไม่ให้ Disk I/O อยู่บน Hot Path ของ Router
+
+/**
+ * @brief บันทึกคำสั่งที่ Router ได้รับลง Capture Buffer (ไม่บล็อก: ถ้า Buffer ทั้งสองเต็มจะทิ้ง Record)
+ */
+void capture_command(const CommandMessage* cmd) {
+    unsigned char rec[sizeof(TraceRecord) + MAX_CHANNEL + MAX_USERNAME + MAX_CHANNEL_LIST + MAX_TEXT_SIZE];
+    TraceRecord hdr;
+
+    hdr.t_ns = (uint64_t)(now_ns() - capture_start_ns);
+    hdr.sender_pid = cmd->sender_pid;
+    hdr.reply_qid = cmd->reply_qid;
+    hdr.session_id = cmd->session_id;
+    hdr.command = (uint8_t)cmd->command;
+    hdr.channel_len = (uint8_t)strnlen(cmd->channel, MAX_CHANNEL);
+    hdr.target_len = (uint8_t)strnlen(cmd->target, MAX_USERNAME);
+    hdr.channels_len = (uint8_t)strnlen(cmd->channels, MAX_CHANNEL_LIST);
+    hdr.text_len = (uint16_t)strnlen(cmd->text, MAX_TEXT_SIZE);
+
+    size_t len = 0;
+    memcpy(rec, &hdr, sizeof(hdr)); len += sizeof(hdr);
+    memcpy(rec + len, cmd->channel, hdr.channel_len); len += hdr.channel_len;
+    memcpy(rec + len, cmd->target, hdr.target_len); len += hdr.target_len;
+    memcpy(rec + len, cmd->channels, hdr.channels_len); len += hdr.channels_len;
+    memcpy(rec + len, cmd->text, hdr.text_len); len += hdr.text_len;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_len[capture_active] + len > CAPTURE_BUFFER_SIZE) {
+        if (capture_pending != -1) {
+            // Writer ยังเขียน Buffer ก่อนหน้าไม่เสร็จ: ทิ้ง Record แทนการบล็อก Router
+            capture_dropped++;
+            pthread_mutex_unlock(&capture_mutex);
+            return;
+        }
+        capture_pending = capture_active;
+        capture_active ^= 1;
+        pthread_cond_signal(&capture_cond);
+    }
+    memcpy(capture_buf[capture_active] + capture_len[capture_active], rec, len);
+    capture_len[capture_active] += len;
+    capture_records++;
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+/**
+ * @brief Thread สำหรับเขียน Capture Buffer ลงไฟล์ (Buffer ที่ยังไม่เต็มจะถูก Flush ทุก 1 วินาที)
+ */
+void* capture_thread(void* arg) {
+    pthread_mutex_lock(&capture_mutex);
+    while (1) {
+        if (capture_pending == -1) {
+            if (capture_stop) {
+                // ปิด Server: Buffer ที่ยังไม่เต็มกลายเป็นชุดสุดท้าย (ถ้าว่างก็จบเลย)
+                if (capture_len[capture_active] == 0) break;
+                capture_pending = capture_active;
+                capture_active ^= 1;
+            } else {
+                int64_t deadline = now_ns() + 1000000000LL;
+                struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+                if (pthread_cond_timedwait(&capture_cond, &capture_mutex, &ts) == ETIMEDOUT &&
+                    capture_pending == -1 && capture_len[capture_active] > 0) {
+                    capture_pending = capture_active;
+                    capture_active ^= 1;
+                }
+                if (capture_pending == -1) continue;
+            }
+        }
+
+        int idx = capture_pending;
+        pthread_mutex_unlock(&capture_mutex);
+
+        if (fwrite(capture_buf[idx], 1, capture_len[idx], capture_file) != capture_len[idx]) {
+            perror("Capture: fwrite failed");
+        }
+        fflush(capture_file);
+
+        pthread_mutex_lock(&capture_mutex);
+        capture_len[idx] = 0;
+        capture_pending = -1;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    return NULL;
+}
+
+/**
+ * @brief เปิดไฟล์ Trace และเขียน Header (เรียกก่อนเริ่ม Router)
+ */
+static int capture_open() {
+    capture_file = fopen(config.capture_path, "wb");
+    if (capture_file == NULL) {
+        perror("Capture: fopen failed");
+        return -1;
+    }
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, capture_file);
+    capture_start_ns = now_ns();
+    printf("Capture: Recording control traffic to %s\n", config.capture_path);
+    return 0;
+}
+
+/**
+ * @brief สั่ง Capture Thread ให้เขียนข้อมูลที่ค้างทั้งหมด รอให้จบ แล้วจึงปิดไฟล์ (เรียกตอนปิด Server หลัง Router หยุดแล้ว)
+ * @details มีเพียง Capture Thread ที่เขียนไฟล์ จึงไม่มี Buffer ใดถูกเขียนซ้ำ และไม่มีใครใช้ FILE หลัง fclose
+ */
+static void capture_close() {
+    if (capture_file == NULL) return;
+    pthread_mutex_lock(&capture_mutex);
+    capture_stop = 1;
+    pthread_cond_signal(&capture_cond);
+    pthread_mutex_unlock(&capture_mutex);
+    pthread_join(capture_tid, NULL);
+
+    fclose(capture_file);
+    capture_file = NULL;
+    printf("Capture: %llu records written, %llu dropped.\n",
+           (unsigned long long)capture_records, (unsigned long long)capture_dropped);
+}
+
+// --- Offline Mailbox (DM ถึงผู้ใช้ที่ไม่ออนไลน์) ---
+// จดหมายอยู่ในไฟล์ mmap แบบ Append-only (ไม่กินหน่วยความจำ Heap ตามจำนวนจดหมาย) ส่วน Index มีขนาดคงที่
+// ผู้รับระบุด้วยชื่อเล่น (Session ID/PID ถูกใช้ซ้ำได้ จดหมายจึงอาจไปถึงคนอื่น) และต้องเป็นชื่อที่เคยมี Client ใช้
+// 1. handle_dm เก็บจดหมายทันทีภายใต้ mailbox_mutex (เขียนต่อท้าย Log + ต่อ Chain ของผู้รับ)
+// 2. handle_nick บันทึกว่าเห็นชื่อนี้ แล้วแค่ส่งคำขอ Flush ให้ Mailbox Thread (ไม่แตะไฟล์, ไม่รอ Compaction)
+// 3. Mailbox Thread ส่งจดหมายเป็นรอบๆ ละ MAILBOX_FLUSH_BATCH ฉบับ และ Compact ไฟล์เมื่อพื้นที่ที่ส่งแล้วเกินครึ่ง
+
+static MailboxHeader* mailbox_header() {
+    return (MailboxHeader*)mailbox_map;
+}
+
+static MailRecord* mailbox_record(uint64_t offset) {
+    return (MailRecord*)(mailbox_map + offset);
+}
+
+// ขนาด Record รวม text ปัดขึ้นให้ลงตัว 8 ไบต์
+static size_t mail_record_size(uint16_t text_len) {
+    return (sizeof(MailRecord) + text_len + 7) & ~(size_t)7;
+}
+
+/**
+ * @brief หา Index Entry ของชื่อเล่นผู้รับ (Open Addressing) ต้องเรียกภายใต้ mailbox_mutex
+ * @param create 1 = สร้าง Entry ใหม่หากยังไม่มี (last_seen = ตอนนี้)
+ * @return Entry หรือ NULL หากไม่พบ/Index เต็ม
+ */
+static MailIndexEntry* mailbox_lookup(const char* recipient, int create) {
+    uint32_t h = fnv1a(recipient);
+    for (int i = 0; i < MAILBOX_INDEX_SIZE; i++) {
+        MailIndexEntry* e = &mailbox_index[(h + i) & (MAILBOX_INDEX_SIZE - 1)];
+        if (strcmp(e->recipient, recipient) == 0) return e;
+        if (e->recipient[0] == '\0') {
+            if (!create) return NULL;
+            snprintf(e->recipient, sizeof(e->recipient), "%s", recipient);
+            e->head = e->tail = 0;
+            e->count = 0;
+            e->key = 0;
+            e->last_session = 0;
+            e->last_seen = time(NULL);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief ต่อ Record ที่ Offset นี้เข้ากับ Chain ของผู้รับ (ภายใต้ mailbox_mutex)
+ * @return 0 หากสำเร็จ, -1 หาก Index เต็ม
+ */
+static int mailbox_link(uint64_t offset) {
+    MailRecord* r = mailbox_record(offset);
+    MailIndexEntry* e = mailbox_lookup(r->recipient, 1);
+    if (e == NULL) return -1;
+
+    r->next = 0;
+    if (e->count == 0) {
+        e->head = offset;
+    } else {
+        mailbox_record(e->tail)->next = offset;
+    }
+    e->tail = offset;
+    e->count++;
+    return 0;
+}
+
+/**
+ * @brief คืน Record ที่ส่งไม่สำเร็จเข้า Chain ของผู้รับตามลำดับ Offset (ภายใต้ mailbox_mutex)
+ * @details Chain เรียงตาม Offset เสมอ (เขียนต่อท้ายเท่านั้น) Record ที่คืนมาจึงมักอยู่หัว Chain
+ */
+static void mailbox_relink(uint64_t offset) {
+    MailRecord* r = mailbox_record(offset);
+    MailIndexEntry* e = mailbox_lookup(r->recipient, 1);
+    if (e == NULL) return; // Index เต็ม: Record ยังเป็น MAIL_PENDING และกลับมาตอนสร้าง Index ใหม่
+
+    if (e->count == 0 || offset > e->tail) {
+        mailbox_link(offset);
+    } else if (offset < e->head) {
+        r->next = e->head;
+        e->head = offset;
+        e->count++;
+    } else {
+        uint64_t prev = e->head;
+        while (mailbox_record(prev)->next != 0 && mailbox_record(prev)->next < offset) prev = mailbox_record(prev)->next;
+        r->next = mailbox_record(prev)->next;
+        mailbox_record(prev)->next = offset;
+        e->count++;
+    }
+    e->retry = 1;
+}
+
+/**
+ * @brief สร้าง Index ใหม่จาก Log (ตอนเปิดไฟล์ หลัง Compact หรือเมื่อมีชื่อที่หมดอายุใน Index)
+ * @details ชื่อที่เคยเห็นและยังไม่หมดอายุ (MAILBOX_SEEN_TTL) ถูกคงไว้แม้ไม่มีจดหมายค้าง
+ */
+static void mailbox_rebuild_index() {
+    static MailIndexEntry seen[MAILBOX_INDEX_SIZE];
+    uint64_t used = mailbox_header()->used;
+    uint64_t offset = sizeof(MailboxHeader);
+    time_t now = time(NULL);
+
+    memcpy(seen, mailbox_index, sizeof(seen));
+    memset(mailbox_index, 0, sizeof(mailbox_index));
+    for (int i = 0; i < MAILBOX_INDEX_SIZE; i++) {
+        if (seen[i].recipient[0] != '\0' && now - seen[i].last_seen < MAILBOX_SEEN_TTL) {
+            MailIndexEntry* e = mailbox_lookup(seen[i].recipient, 1);
+            e->last_seen = seen[i].last_seen;
+            e->key = seen[i].key;
+            e->last_session = seen[i].last_session;
+        }
+    }
+
+    mailbox_dead = 0;
+    while (offset + sizeof(MailRecord) <= used) {
+        MailRecord* r = mailbox_record(offset);
+        size_t size = mail_record_size(r->text_len);
+        if (offset + size > used) break;
+        r->recipient[NICK_MAX_LEN] = r->sender[NICK_MAX_LEN] = '\0'; // ไฟล์อาจเสีย
+        // ไม่มีจดหมายที่กำลังส่งระหว่างสร้าง Index (mailbox_inflight = 0) MAIL_SENDING ที่เหลือมาจาก Server ที่ปิดไปกลางคัน
+        if (r->delivered == MAIL_SENDING) r->delivered = MAIL_PENDING;
+        if (r->delivered == MAIL_PENDING && mailbox_link(offset) == -1) {
+            fprintf(stderr, "Mailbox: Index full, dropping message for %s.\n", r->recipient);
+            r->delivered = MAIL_DELIVERED;
+        } else if (r->delivered == MAIL_PENDING) {
+            MailIndexEntry* e = mailbox_lookup(r->recipient, 0);
+            if (e->key == 0) e->key = r->owner_key; // ชื่อที่มีจดหมายค้างยังถูกจองให้เจ้าของเดิม
+        }
+        if (r->delivered == MAIL_DELIVERED) mailbox_dead += size;
+        offset += size;
+    }
+}
+
+/**
+ * @brief ขยายไฟล์ (ftruncate + mremap) ให้มีที่ว่างอย่างน้อย bytes ไบต์ต่อท้าย Log
+ */
+static int mailbox_reserve(size_t bytes) {
+    uint64_t used = mailbox_header()->used;
+    if (used + bytes <= mailbox_size) return 0;
+
+    size_t new_size = mailbox_size * 2;
+    while (used + bytes > new_size) new_size *= 2;
+    if (ftruncate(mailbox_fd, new_size) == -1) {
+        perror("Mailbox: ftruncate");
+        return -1;
+    }
+    void* map = mremap(mailbox_map, mailbox_size, new_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        perror("Mailbox: mremap");
+        return -1;
+    }
+    mailbox_map = map;
+    mailbox_size = new_size;
+    return 0;
+}
+
+/**
+ * @brief Map ไฟล์ Mailbox ที่ path (สร้างใหม่หากยังไม่มี) ขนาดอย่างน้อย min_size
+ * @return fd หรือ -1 หากล้มเหลว (*map, *size ถูกตั้งค่าเมื่อสำเร็จ)
+ */
+static int mailbox_map_file(const char* path, int flags, size_t min_size, unsigned char** map, size_t* size) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | flags, 0600);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("Mailbox: open");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    *size = (size_t)st.st_size;
+    if (*size < min_size) {
+        if (ftruncate(fd, min_size) == -1) {
+            perror("Mailbox: ftruncate");
+            close(fd);
+            return -1;
+        }
+        *size = min_size;
+    }
+    *map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+        perror("Mailbox: mmap");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief เปิดไฟล์ Mailbox และสร้าง Index จากจดหมายที่ค้างอยู่ (เรียกก่อนเริ่ม Router)
+ * @return 0 หากสำเร็จ, -1 หากเปิดไม่ได้หรือไฟล์ไม่ใช่ Mailbox (Server ทำงานต่อโดยไม่มี Mailbox)
+ */
+static int mailbox_open() {
+    // ตรวจ Magic ก่อน Map (mailbox_map_file ขยายไฟล์ จึงไม่ควรแตะไฟล์ที่ไม่ใช่ Mailbox)
+    FILE* f = fopen(config.mailbox_path, "rb");
+    if (f != NULL) {
+        char magic[sizeof(((MailboxHeader*)0)->magic)];
+        size_t n = fread(magic, 1, sizeof(magic), f);
+        fclose(f);
+        if (n > 0 && (n < sizeof(magic) || memcmp(magic, MAILBOX_MAGIC, sizeof(magic)) != 0)) {
+            fprintf(stderr, "Mailbox: %s is not a mailbox file (or an older format). Offline delivery disabled.\n", config.mailbox_path);
+            return -1;
+        }
+    }
+
+    mailbox_fd = mailbox_map_file(config.mailbox_path, 0, MAILBOX_INITIAL_SIZE, &mailbox_map, &mailbox_size);
+    if (mailbox_fd == -1) return -1;
+
+    MailboxHeader* hdr = mailbox_header();
+    if (hdr->used == 0) {
+        // ไฟล์ใหม่ (ftruncate เติมศูนย์ให้แล้ว)
+        memcpy(hdr->magic, MAILBOX_MAGIC, sizeof(hdr->magic));
+        hdr->used = sizeof(MailboxHeader);
+    } else if (memcmp(hdr->magic, MAILBOX_MAGIC, sizeof(hdr->magic)) != 0 || hdr->used > mailbox_size) {
+        fprintf(stderr, "Mailbox: %s is not a mailbox file. Offline delivery disabled.\n", config.mailbox_path);
+        munmap(mailbox_map, mailbox_size);
+        close(mailbox_fd);
+        mailbox_map = NULL;
+        mailbox_fd = -1;
+        return -1;
+    }
+
+    mailbox_rebuild_index();
+    int users = 0, pending = 0;
+    for (int i = 0; i < MAILBOX_INDEX_SIZE; i++) {
+        if (mailbox_index[i].count > 0) { users++; pending += mailbox_index[i].count; }
+    }
+    mailbox_enabled = 1;
+    printf("Mailbox: %s (%d pending messages for %d users).\n", config.mailbox_path, pending, users);
+    return 0;
+}
+
+/**
+ * @brief เก็บ DM ลง Mailbox ของชื่อเล่นที่ไม่ออนไลน์ (เรียกจาก handle_dm)
+ * @param sender ชื่อเล่นของผู้ส่ง หรือ Session ID (ตัวเลข) หากไม่ได้ตั้งชื่อ
+ * @return จำนวนจดหมายค้างของผู้รับหลังเก็บ, 0 หากไม่เคยมีใครใช้ชื่อนี้ หรือ -1 หาก Mailbox เต็ม
+ */
+int mailbox_store(const char* recipient, const char* sender, const char* text) {
+    uint16_t len = (uint16_t)strnlen(text, MAX_TEXT_SIZE - 1);
+    size_t size = mail_record_size(len);
+    int pending = -1;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    MailIndexEntry* e = mailbox_lookup(recipient, 0);
+    if (e == NULL) {
+        pending = 0; // ไม่รับจดหมายถึงชื่อที่ไม่เคยเห็น (กันไม่ให้ Client คนเดียวเติมไฟล์จนเต็ม)
+    } else if (e->count < MAILBOX_MAX_PER_USER && mailbox_reserve(size) == 0) {
+        MailboxHeader* hdr = mailbox_header();
+        uint64_t offset = hdr->used;
+        MailRecord* r = mailbox_record(offset);
+        memset(r, 0, sizeof(MailRecord));
+        snprintf(r->recipient, sizeof(r->recipient), "%s", recipient);
+        snprintf(r->sender, sizeof(r->sender), "%s", sender);
+        r->owner_key = e->key;
+        r->stored_at = time(NULL);
+        r->text_len = len;
+        memcpy(r + 1, text, len);
+        hdr->used += size;
+        mailbox_link(offset);
+        pending = (int)e->count;
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    return pending;
+}
+
+/**
+ * @brief บันทึกว่ามี Client ตั้ง/เลิกใช้ชื่อเล่นนี้ ชื่อนี้จึงรับจดหมายได้ (เรียกภายใต้ Registry WRITE Lock)
+ * @return จำนวนจดหมายค้างของชื่อนี้ หรือ -1 หาก Index เต็ม
+ */
+int mailbox_seen(const char* nick) {
+    int pending = -1;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    MailIndexEntry* e = mailbox_lookup(nick, 1);
+    if (e != NULL) {
+        e->last_seen = time(NULL);
+        pending = (int)e->count;
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    if (e == NULL) fprintf(stderr, "Mailbox: Index full, %s cannot receive offline messages.\n", nick);
+    return pending;
+}
+
+/**
+ * @brief ตรวจสิทธิ์และบันทึกการตั้งชื่อเล่น (เรียกจาก handle_nick ภายใต้ Registry WRITE Lock)
+ * @details ชื่อที่ยังอยู่ใน Index (มีจดหมายค้าง หรือมีคนใช้ภายใน MAILBOX_SEEN_TTL) ถูกจองให้เจ้าของเดิม
+ * ต้องแนบ Key ที่ออกให้ตอนตั้งชื่อครั้งแรกมาด้วย ชื่อใหม่หรือชื่อที่หมดอายุแล้วได้ Key ใหม่
+ * @param key_text Key ที่ Client แนบมา (เลขฐาน 16, "" = ไม่มี)
+ * @param key_out Key ของชื่อนี้ (ใช้ตอบกลับเจ้าของ)
+ * @return จำนวนจดหมายค้าง, -1 หาก Index เต็ม (ตั้งชื่อได้แต่ไม่มี Mailbox), -2 หาก Key ไม่ตรง
+ */
+int mailbox_claim(const char* nick, const char* key_text, SessionId session, uint64_t* key_out) {
+    uint64_t key = strtoull(key_text, NULL, 16);
+    time_t now = time(NULL);
+    int pending = -1;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    MailIndexEntry* e = mailbox_lookup(nick, 1);
+    if (e != NULL && e->count == 0 && now - e->last_seen >= MAILBOX_SEEN_TTL) e->key = 0; // หมดอายุ: ใครก็ตั้งได้
+    if (e != NULL && e->key != 0 && e->key != key) {
+        pending = -2;
+    } else if (e != NULL) {
+        while (e->key == 0) {
+            if (getrandom(&e->key, sizeof(e->key), 0) != sizeof(e->key)) e->key = ((uint64_t)now << 32) ^ (uint64_t)now_ns();
+        }
+        e->last_seen = now;
+        e->last_session = session;
+        *key_out = e->key;
+        pending = (int)e->count;
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    if (e == NULL) fprintf(stderr, "Mailbox: Index full, %s cannot receive offline messages.\n", nick);
+    return pending;
+}
+
+/**
+ * @brief หาชื่อเล่นล่าสุดของ Session ที่ไม่ออนไลน์แล้ว (DM <PID> จึงเก็บเข้า Mailbox ของชื่อนั้นได้)
+ * @details PID ถูกใช้ซ้ำได้ แต่จดหมายไปอยู่ในชื่อที่ถูกจองด้วย Key ไม่ใช่ใน PID
+ * @return 1 หากพบ (nick ถูกตั้งค่า), 0 หาก Session นี้ไม่เคยตั้งชื่อ
+ */
+int mailbox_nick_of(SessionId session, char nick[NICK_MAX_LEN + 1]) {
+    const MailIndexEntry* best = NULL;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    for (int i = 0; i < MAILBOX_INDEX_SIZE; i++) {
+        const MailIndexEntry* e = &mailbox_index[i];
+        if (e->recipient[0] != '\0' && e->last_session == session && (best == NULL || e->last_seen > best->last_seen)) best = e;
+    }
+    if (best != NULL) strcpy(nick, best->recipient);
+    pthread_mutex_unlock(&mailbox_mutex);
+    return best != NULL;
+}
+
+/**
+ * @brief ขอให้ Mailbox Thread ส่งจดหมายที่ค้างให้ Client ที่เพิ่งตั้งชื่อเล่นนี้ (ไม่บล็อก)
+ */
+void mailbox_request_flush(const char* nick) {
+    MailFlushRequest* req = (MailFlushRequest*)malloc(sizeof(MailFlushRequest));
+    snprintf(req->nick, sizeof(req->nick), "%s", nick);
+    req->next = NULL;
+
+    pthread_mutex_lock(&mailbox_req_mutex);
+    if (mailbox_req_tail) {
+        mailbox_req_tail->next = req;
+    } else {
+        mailbox_req_head = req;
+    }
+    mailbox_req_tail = req;
+    pthread_cond_signal(&mailbox_cond);
+    pthread_mutex_unlock(&mailbox_req_mutex);
+}
+
+/**
+ * @brief Broadcaster แจ้งผลการส่งจดหมาย (Job CMD_MAIL) ที่ Offset นี้
+ * @param ok 1 = เข้า Reply Queue แล้ว (MAIL_DELIVERED), 0 = คิวเต็ม/Client หลุด (คืนเข้า Chain เพื่อส่งใหม่)
+ */
+void mailbox_sent(uint64_t offset, int ok) {
+    pthread_mutex_lock(&mailbox_mutex);
+    if (!mailbox_enabled) { // Broadcaster ส่งเสร็จหลังปิดไฟล์แล้ว: สถานะในไฟล์ยังเป็น SENDING และกลับเป็น PENDING ตอนเปิดใหม่
+        pthread_mutex_unlock(&mailbox_mutex);
+        return;
+    }
+    MailRecord* r = mailbox_record(offset);
+    if (ok) {
+        r->delivered = MAIL_DELIVERED;
+        mailbox_dead += mail_record_size(r->text_len);
+    } else {
+        r->delivered = MAIL_PENDING;
+        mailbox_relink(offset);
+    }
+    if (--mailbox_inflight == 0) pthread_cond_broadcast(&mailbox_sent_cond);
+    pthread_mutex_unlock(&mailbox_mutex);
 }
 
-void handle_dm(const CommandMessage* cmd) {
-    // ต้องใช้ READ Lock เพราะแค่ตรวจสอบ PID และดึง QID
-    pthread_rwlock_rdlock(&registry.rwlock);
-    
-    int sender_idx = find_client_index(cmd->sender_pid);
-    if (sender_idx == -1) { pthread_rwlock_unlock(&registry.rwlock); return; }
+/**
+ * @brief ส่งจดหมายที่ค้างทั้งหมดของชื่อเล่นเป็นรอบๆ (เรียกจาก Mailbox Thread)
+ * @details แต่ละรอบหา Endpoint ปัจจุบันของเจ้าของชื่อก่อนดึงจดหมาย แล้วรอ Broadcaster แจ้งผลครบทุกฉบับ
+ * ก่อนรอบถัดไป หากเจ้าของหลุด เปลี่ยนชื่อ หรือคิวเต็มระหว่างทาง จดหมายที่เหลือจะยังอยู่ใน Mailbox
+ * (Lock Order: registry -> mailbox_mutex)
+ */
+static void mailbox_flush(const char* nick) {
+    int batch_no = 0;
 
-    // แปลง Target PID string เป็น PID
-    pid_t target_pid = (pid_t)atoi(cmd->target);
-    int target_idx = find_client_index(target_pid);
+    while (1) {
+        pthread_rwlock_rdlock(&registry.rwlock);
+        int client_idx = nick_lookup(nick);
+        if (client_idx == -1) {
+            pthread_rwlock_unlock(&registry.rwlock);
+            return;
+        }
 
-    if (target_idx == -1) {
-        // ส่ง Error กลับไปหาผู้ส่ง
-        Job* error_job = (Job*)malloc(sizeof(Job));
-        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
-        strcpy(error_job->sender_name, "SERVER");
-        sprintf(error_job->message, "Error: User PID %s is not online.", cmd->target);
-        add_job(error_job);
+        Job* batch[MAILBOX_FLUSH_BATCH];
+        int n = 0, total = 0;
+        pthread_mutex_lock(&mailbox_mutex);
+        MailIndexEntry* e = mailbox_lookup(nick, 0);
+        if (e != NULL) total = (int)e->count;
+        while (e != NULL && e->count > 0 && n < MAILBOX_FLUSH_BATCH) {
+            MailRecord* r = mailbox_record(e->head);
+            Job* job = (Job*)malloc(sizeof(Job));
+            job->type = CMD_MAIL;
+            job->mail_offset = e->head;
+            snprintf(job->sender_name, MAX_USERNAME, "(saved DM from %s)", r->sender);
+            memcpy(job->message, r + 1, r->text_len);
+            job->message[r->text_len] = '\0';
+            batch[n++] = job;
+
+            // ยังไม่นับว่าส่งแล้ว: รอ mailbox_sent จาก Broadcaster
+            r->delivered = MAIL_SENDING;
+            mailbox_inflight++;
+            e->head = r->next;
+            if (--e->count == 0) e->head = e->tail = 0;
+        }
+        if (e != NULL) e->retry = 0;
+        pthread_mutex_unlock(&mailbox_mutex);
+
+        if (n > 0 && batch_no == 0) {
+            Job* notice = (Job*)malloc(sizeof(Job));
+            notice->type = CMD_DM;
+            notice->target_qid = registry.clients[client_idx].reply_qid;
+            notice->target_mtype = registry.clients[client_idx].reply_mtype;
+            strcpy(notice->sender_name, "SERVER");
+            sprintf(notice->message, "You have %d offline message(s).", total);
+            add_job(notice);
+        }
+        for (int i = 0; i < n; i++) {
+            batch[i]->target_qid = registry.clients[client_idx].reply_qid;
+            batch[i]->target_mtype = registry.clients[client_idx].reply_mtype;
+            add_job(batch[i]);
+        }
         pthread_rwlock_unlock(&registry.rwlock);
-        return;
-    }
 
-    // 1. Job สำหรับ Target (DM)
-    Job* target_job = (Job*)malloc(sizeof(Job));
-    target_job->type = CMD_DM;
-    target_job->target_qid = registry.clients[target_idx].reply_qid;
-    sprintf(target_job->sender_name, "(DM from %d)", cmd->sender_pid);
-    strncpy(target_job->message, cmd->text, MAX_TEXT_SIZE);
-    add_job(target_job);
-    
-    // 2. Confirmation Job สำหรับผู้ส่ง
-    Job* confirm_job = (Job*)malloc(sizeof(Job));
-    confirm_job->type = CMD_DM;
-    confirm_job->target_qid = cmd->reply_qid;
-    strcpy(confirm_job->sender_name, "SERVER");
-    sprintf(confirm_job->message, "DM sent to %d.", target_pid);
-    add_job(confirm_job);
+        // รอผลของรอบนี้ (Compaction และรอบถัดไปจึงไม่เห็น MAIL_SENDING) หยุดหากมีฉบับที่ส่งไม่สำเร็จ
+        pthread_mutex_lock(&mailbox_mutex);
+        while (mailbox_inflight > 0) pthread_cond_wait(&mailbox_sent_cond, &mailbox_mutex);
+        int failed = e != NULL && e->retry;
+        pthread_mutex_unlock(&mailbox_mutex);
 
-    pthread_rwlock_unlock(&registry.rwlock);
+        if (n < MAILBOX_FLUSH_BATCH || failed) return;
+        batch_no++;
+        usleep(MAILBOX_FLUSH_PAUSE_MS * 1000); // ให้ Client อ่าน Reply Queue ก่อนรอบถัดไป
+    }
 }
 
-void handle_who(const CommandMessage* cmd) {
-    // ต้องใช้ READ Lock เพราะแค่ตรวจสอบ Room และดึงรายชื่อสมาชิก
-    pthread_rwlock_rdlock(&registry.rwlock);
-    
-    int client_idx = find_client_index(cmd->sender_pid);
-    if (client_idx == -1) { pthread_rwlock_unlock(&registry.rwlock); return; }
+/**
+ * @brief คัดลอกจดหมายที่ยังไม่ได้ส่งในช่วง [from, to) ของ src ไปต่อท้าย dst ที่ pos
+ * @return pos ใหม่ (ผู้เรียกต้องเตรียมที่ว่างใน dst อย่างน้อย to - from ไบต์)
+ */
+static uint64_t mailbox_copy_live(const unsigned char* src, uint64_t from, uint64_t to, unsigned char* dst, uint64_t pos) {
+    uint64_t offset = from;
+    while (offset + sizeof(MailRecord) <= to) {
+        const MailRecord* r = (const MailRecord*)(src + offset);
+        size_t size = mail_record_size(r->text_len);
+        if (offset + size > to) break;
+        if (r->delivered != MAIL_DELIVERED) {
+            memcpy(dst + pos, r, size);
+            pos += size;
+        }
+        offset += size;
+    }
+    return pos;
+}
 
-    int room_idx = find_room_index(cmd->channel);
-    
-    Job* reply_job = (Job*)malloc(sizeof(Job));
-    reply_job->type = CMD_WHO; 
-    reply_job->target_qid = cmd->reply_qid;
-    strcpy(reply_job->sender_name, "SERVER");
+static void mailbox_compact_abort(int fd, unsigned char* map, size_t size, const char* tmp_path) {
+    munmap(map, size);
+    close(fd);
+    unlink(tmp_path);
+}
 
-    if (room_idx == -1) {
-        sprintf(reply_job->message, "Error: Channel %s does not exist.", cmd->channel);
-    } else {
-        char buffer[MAX_TEXT_SIZE];
-        char* ptr = buffer;
-        int remaining = MAX_TEXT_SIZE;
-        
-        int written = snprintf(ptr, remaining, "Members of %s (%d): ", cmd->channel, registry.rooms[room_idx].member_count);
-        ptr += written; remaining -= written;
+/**
+ * @brief เขียนเฉพาะจดหมายที่ยังไม่ได้ส่งลงไฟล์ใหม่ แล้วสลับแทนไฟล์เดิม (rename)
+ * @details ทำงานใน Mailbox Thread ส่วนใหญ่ไม่ถือ mailbox_mutex:
+ * 1. จำ used ตอนเริ่มไว้ แล้วคัดลอก Log ถึงตรงนั้นผ่าน Mapping แบบอ่านอย่างเดียวของตัวเอง
+ *    (mailbox_map อาจย้ายได้เมื่อ mailbox_store เรียก mremap) และ msync ไฟล์ใหม่
+ *    ระหว่างนั้น handle_dm เขียนต่อท้ายได้ แต่ใน Record เดิมแก้แค่ next ซึ่งถูกสร้างใหม่ตอนท้ายอยู่แล้ว
+ *    (ไม่มีจดหมายสถานะ MAIL_SENDING ระหว่างนี้ เพราะ mailbox_flush รอผลครบก่อนคืนการทำงานให้ Thread นี้)
+ * 2. Lock เฉพาะตอนต่อจดหมายที่ถูกเขียนเพิ่มระหว่างคัดลอกและสลับไฟล์
+ *    handle_dm จึงรอแค่ช่วงนี้ ไม่รอ I/O ของไฟล์ทั้งไฟล์
+ */
+static void mailbox_compact() {
+    char tmp_path[sizeof(config.mailbox_path) + 8];
+    unsigned char* new_map;
+    size_t new_size;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", config.mailbox_path);
+    pthread_mutex_lock(&mailbox_mutex);
+    uint64_t old_used = mailbox_header()->used;
+    uint64_t live = old_used - mailbox_dead;
+    int old_fd = mailbox_fd;
+    pthread_mutex_unlock(&mailbox_mutex);
+
+    size_t want = MAILBOX_INITIAL_SIZE;
+    while (want < live) want *= 2;
+    unsigned char* view = mmap(NULL, old_used, PROT_READ, MAP_SHARED, old_fd, 0);
+    if (view == MAP_FAILED) {
+        perror("Mailbox: mmap");
+        return;
+    }
+    int fd = mailbox_map_file(tmp_path, O_TRUNC, want, &new_map, &new_size);
+    if (fd == -1) {
+        munmap(view, old_used);
+        return;
+    }
 
-        for (int i = 0; i < registry.rooms[room_idx].member_count; i++) {
-            written = snprintf(ptr, remaining, "%d%s", registry.rooms[room_idx].members[i], 
-                               i < registry.rooms[room_idx].member_count - 1 ? ", " : "");
-            ptr += written; remaining -= written;
-            if (remaining <= 1) break; 
+    uint64_t pos = mailbox_copy_live(view, sizeof(MailboxHeader), old_used, new_map, sizeof(MailboxHeader));
+    munmap(view, old_used);
+    if (msync(new_map, pos, MS_SYNC) == -1) {
+        perror("Mailbox: compaction failed");
+        mailbox_compact_abort(fd, new_map, new_size, tmp_path);
+        return;
+    }
+
+    pthread_mutex_lock(&mailbox_mutex);
+    if (!mailbox_enabled) { // ปิด Server ระหว่างคัดลอก
+        pthread_mutex_unlock(&mailbox_mutex);
+        mailbox_compact_abort(fd, new_map, new_size, tmp_path);
+        return;
+    }
+    uint64_t used = mailbox_header()->used;
+    if (pos + (used - old_used) > new_size) {
+        size_t grown = new_size;
+        while (pos + (used - old_used) > grown) grown *= 2;
+        void* map = ftruncate(fd, grown) == 0 ? mremap(new_map, new_size, grown, MREMAP_MAYMOVE) : MAP_FAILED;
+        if (map == MAP_FAILED) {
+            perror("Mailbox: compaction failed");
+            pthread_mutex_unlock(&mailbox_mutex);
+            mailbox_compact_abort(fd, new_map, new_size, tmp_path);
+            return;
         }
-        strncpy(reply_job->message, buffer, MAX_TEXT_SIZE);
+        new_map = map;
+        new_size = grown;
     }
-    add_job(reply_job);
-    
-    pthread_rwlock_unlock(&registry.rwlock);
+    pos = mailbox_copy_live(mailbox_map, old_used, used, new_map, pos);
+    MailboxHeader* hdr = (MailboxHeader*)new_map;
+    memcpy(hdr->magic, MAILBOX_MAGIC, sizeof(hdr->magic));
+    hdr->used = pos;
+
+    if (rename(tmp_path, config.mailbox_path) == -1) {
+        perror("Mailbox: compaction failed");
+        pthread_mutex_unlock(&mailbox_mutex);
+        mailbox_compact_abort(fd, new_map, new_size, tmp_path);
+        return;
+    }
+    munmap(mailbox_map, mailbox_size);
+    close(mailbox_fd);
+    mailbox_map = new_map;
+    mailbox_size = new_size;
+    mailbox_fd = fd;
+    mailbox_rebuild_index(); // สร้าง Chain (next) ใหม่ทั้งหมด
+    pthread_mutex_unlock(&mailbox_mutex);
+
+    printf("Mailbox: Compacted %llu -> %llu bytes.\n", (unsigned long long)used, (unsigned long long)pos);
 }
 
-void handle_leave(const CommandMessage* cmd) {
-    // ต้องใช้ WRITE Lock เพราะมีการแก้ไข Client/Room Registry
-    pthread_rwlock_wrlock(&registry.rwlock);
+/**
+ * @brief ตรวจว่าควร Compact ไฟล์ หรือแค่สร้าง Index ใหม่เพื่อลบชื่อที่หมดอายุออกจาก Index
+ */
+static void mailbox_maintain() {
+    pthread_mutex_lock(&mailbox_mutex);
+    uint64_t used = mailbox_header()->used;
+    int compact = mailbox_dead >= MAILBOX_COMPACT_MIN && mailbox_dead * 2 >= used;
+    int expired = 0;
+    time_t now = time(NULL);
+    for (int i = 0; i < MAILBOX_INDEX_SIZE; i++) {
+        MailIndexEntry* e = &mailbox_index[i];
+        if (e->recipient[0] != '\0' && e->count == 0 && now - e->last_seen >= MAILBOX_SEEN_TTL) expired++;
+    }
+    if (!compact && expired > 0) mailbox_rebuild_index();
+    pthread_mutex_unlock(&mailbox_mutex);
 
-    int client_idx = find_client_index(cmd->sender_pid);
-    if (client_idx == -1) { pthread_rwlock_unlock(&registry.rwlock); return; }
+    if (compact) mailbox_compact();
+}
 
-    char old_channel[MAX_CHANNEL];
-    strcpy(old_channel, registry.clients[client_idx].current_channel);
-    
-    if (old_channel[0] == '\0') {
-        Job* error_job = (Job*)malloc(sizeof(Job));
-        error_job->type = CMD_DM; error_job->target_qid = cmd->reply_qid;
-        strcpy(error_job->sender_name, "SERVER");
-        strcpy(error_job->message, "Error: You are not currently in any channel.");
-        add_job(error_job);
-        pthread_rwlock_unlock(&registry.rwlock);
-        return;
+/**
+ * @brief ขอ Flush ใหม่ให้ทุกชื่อที่มีจดหมายส่งไม่สำเร็จ (เรียกตอน Mailbox Thread ว่าง จึงลองใหม่ไม่ถี่เกินไป)
+ */
+static void mailbox_retry() {
+    char nicks[MAX_CLIENTS][NICK_MAX_LEN + 1];
+    int n = 0;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    for (int i = 0; i < MAILBOX_INDEX_SIZE && n < MAX_CLIENTS; i++) {
+        if (mailbox_index[i].retry && mailbox_index[i].count > 0) strcpy(nicks[n++], mailbox_index[i].recipient);
+        mailbox_index[i].retry = 0;
     }
+    pthread_mutex_unlock(&mailbox_mutex);
 
-    // 1. ลบ Client ออกจาก Room Registry
-    int room_idx = find_room_index(old_channel);
-    if (room_idx != -1) {
-        remove_client_from_room(room_idx, cmd->sender_pid);
-        
-        // Broadcast แจ้งการออก
-        Job* leave_job = (Job*)malloc(sizeof(Job));
-        leave_job->type = CMD_MSG;
-        strcpy(leave_job->sender_name, "SERVER");
-        strcpy(leave_job->target_channel, old_channel);
-        sprintf(leave_job->message, "User %d left the channel.", cmd->sender_pid);
-        add_job(leave_job);
-    }
+    for (int i = 0; i < n; i++) mailbox_request_flush(nicks[i]);
+}
 
-    // 2. ล้างสถานะ Channel ของ Client
-    strcpy(registry.clients[client_idx].current_channel, "");
+/**
+ * @brief Thread สำหรับส่งจดหมายที่ค้าง (ตามคำขอจาก handle_nick) และ Compact ไฟล์เป็นระยะ
+ */
+void* mailbox_thread(void* arg) {
+    pthread_mutex_lock(&mailbox_req_mutex);
+    while (!mailbox_stop) {
+        if (mailbox_req_head == NULL) {
+            int64_t deadline = now_ns() + (int64_t)MAILBOX_COMPACT_CHECK_MS * 1000000;
+            struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+            pthread_cond_timedwait(&mailbox_cond, &mailbox_req_mutex, &ts);
+            if (mailbox_stop) break;
+            if (mailbox_req_head == NULL) {
+                pthread_mutex_unlock(&mailbox_req_mutex);
+                mailbox_maintain();
+                mailbox_retry();
+                pthread_mutex_lock(&mailbox_req_mutex);
+                continue;
+            }
+        }
 
-    // 3. ส่งยืนยัน
-    Job* confirm_job = (Job*)malloc(sizeof(Job));
-    confirm_job->type = CMD_DM; 
-    confirm_job->target_qid = cmd->reply_qid;
-    strcpy(confirm_job->sender_name, "SERVER");
-    sprintf(confirm_job->message, "You have left %s.", old_channel);
-    add_job(confirm_job);
+        MailFlushRequest* req = mailbox_req_head;
+        mailbox_req_head = req->next;
+        if (mailbox_req_head == NULL) mailbox_req_tail = NULL;
+        pthread_mutex_unlock(&mailbox_req_mutex);
 
-    pthread_rwlock_unlock(&registry.rwlock);
+        mailbox_flush(req->nick);
+        free(req);
+        mailbox_maintain();
+
+        pthread_mutex_lock(&mailbox_req_mutex);
+    }
+    // คำขอที่ค้างในคิวไม่ต้องทำต่อ: จดหมายยังเป็น PENDING ในไฟล์และจะถูกส่งเมื่อเจ้าของกลับมาครั้งหน้า
+    pthread_mutex_unlock(&mailbox_req_mutex);
+    return NULL;
 }
 
+/**
+ * @brief หยุดและ join Mailbox Thread แล้วบันทึกไฟล์ Mailbox ลงดิสก์และปิด (เรียกตอนปิด Server หลัง Router หยุดแล้ว)
+ */
+static void mailbox_close() {
+    if (mailbox_running) {
+        pthread_mutex_lock(&mailbox_req_mutex);
+        mailbox_stop = 1;
+        pthread_cond_signal(&mailbox_cond);
+        pthread_mutex_unlock(&mailbox_req_mutex);
+        pthread_join(mailbox_tid, NULL);
+        mailbox_running = 0;
+    }
+    if (!mailbox_enabled) return;
+    pthread_mutex_lock(&mailbox_mutex);
+    msync(mailbox_map, mailbox_size, MS_SYNC);
+    munmap(mailbox_map, mailbox_size);
+    close(mailbox_fd);
+    mailbox_map = NULL;
+    mailbox_enabled = 0;
+    pthread_mutex_unlock(&mailbox_mutex);
+}
 
 // --- Server Thread Functions ---
 
 /**
- * @brief Thread หลักของ Router: อ่านคำสั่งจาก Control Queue และส่งต่อให้ Handlers
+ * @brief Thread หลักของ Router: อ่านคำสั่งจาก Transport (Control Queue หรือ Socket) และส่งต่อให้ Handlers
  */
 void router_thread() {
     CommandMessage cmd_msg;
     int client_idx;
 
     while (1) {
-        // อ่านจาก Control Queue (Blocking)
-        ssize_t size = msgrcv(control_qid, &cmd_msg, sizeof(CommandMessage) - sizeof(long), MSG_TYPE_COMMAND, 0);
-
-        if (size == -1) {
-            if (errno == EINTR) continue; 
-            if (errno == EIDRM) {
-                printf("\nRouter: Control Queue removed. Exiting router thread...\n");
-                break; // Server กำลังปิดตัว
-            }
-            perror("msgrcv (router)");
-            continue;
+        // อ่านคำสั่งถัดไปจาก Transport (Blocking)
+        if (transport->recv_command(&cmd_msg) == -1) {
+            break; // Server กำลังปิดตัว
         }
+        cmd_msg.stamps.router_recv_ns = now_ns();
+        if (capture_file) capture_command(&cmd_msg);
         
-        // --- อัปเดตเวลา Active (ต้องใช้ WRITE Lock ชั่วขณะ) ---
-        pthread_rwlock_wrlock(&registry.rwlock);
-        client_idx = find_client_index(cmd_msg.sender_pid);
+        // --- อัปเดตเวลา Active (ค้นหาผ่าน Seqlock, last_active เป็น Atomic จึงไม่ต้องใช้ WRITE Lock) ---
+        ClientLookup lookup = { .session = cmd_session(&cmd_msg) };
+        registry_read(copy_client_lookup, &lookup);
+        client_idx = lookup.idx;
         if (client_idx != -1) {
             // อัปเดตเวลาที่ Client ล่าสุดส่งคำสั่งมา
-            registry.clients[client_idx].last_active = time(NULL);
+            atomic_store_explicit(&registry.clients[client_idx].last_active, time(NULL), memory_order_relaxed);
         }
-        pthread_rwlock_unlock(&registry.rwlock);
         // --------------------------------------------------------
 
-        printf("Router: Received command %d from PID %d\n", cmd_msg.command, cmd_msg.sender_pid);
-        
-        // ประมวลผลคำสั่ง: เรียก Handler ที่เหมาะสม
-        switch (cmd_msg.command) {
-            case CMD_REGISTER:
-                handle_register(&cmd_msg);
-                break;
-            case CMD_JOIN:
-                handle_join(&cmd_msg);
-                break;
-            case CMD_MSG:
-                handle_msg(&cmd_msg);
-                break;
-            case CMD_DM:
-                handle_dm(&cmd_msg);
-                break;
-            case CMD_WHO:
-                handle_who(&cmd_msg);
-                break;
-            case CMD_LEAVE:
-                handle_leave(&cmd_msg);
-                break;
-            case CMD_QUIT:
-                handle_quit(&cmd_msg);
-                break;
-            default:
-                fprintf(stderr, "Router: Received unknown command code %d\n", cmd_msg.command);
-                break;
+        printf("Router: Received command %d from PID %d (Session %ld)\n", cmd_msg.command, cmd_msg.sender_pid, cmd_session(&cmd_msg));
+
+        // ตรวจสอบ Rate Limit ก่อน Dispatch (Client ที่ยังไม่ลงทะเบียนมีแค่ CMD_REGISTER)
+        if (client_idx != -1 && !admit_command(client_idx, &cmd_msg)) {
+            continue;
         }
+
+        dispatch_command(&cmd_msg);
+    }
+}
+
+/**
+ * @brief เรียก Handler ที่เหมาะสมกับคำสั่ง (เรียกจาก Router หรือ Delay Thread)
+ */
+void dispatch_command(const CommandMessage* cmd) {
+    dispatch_stamps = &cmd->stamps;
+    switch (cmd->command) {
+        case CMD_REGISTER:
+            handle_register(cmd);
+            break;
+        case CMD_JOIN:
+            handle_join(cmd);
+            break;
+        case CMD_MSG:
+            handle_msg(cmd);
+            break;
+        case CMD_DM:
+            handle_dm(cmd);
+            break;
+        case CMD_WHO:
+            handle_who(cmd);
+            break;
+        case CMD_LEAVE:
+            handle_leave(cmd);
+            break;
+        case CMD_QUIT:
+            handle_quit(cmd);
+            break;
+        case CMD_SUB:
+        case CMD_UNSUB:
+            handle_sub(cmd);
+            break;
+        case CMD_PUB:
+            handle_pub(cmd);
+            break;
+        case CMD_MULTICAST:
+        case CMD_ANNOUNCE:
+            handle_multicast(cmd);
+            break;
+        case CMD_NICK:
+            handle_nick(cmd);
+            break;
+        default:
+            fprintf(stderr, "Router: Received unknown command code %d\n", cmd->command);
+            break;
     }
+    dispatch_stamps = NULL;
+}
+
+/**
+ * @brief รายงานขนาดและอัตราการใช้งานของ Broadcaster Pool (เรียกจาก Monitor Thread)
+ * @param period_ns ระยะเวลาตั้งแต่รายงานครั้งก่อน
+ */
+static void report_pool_telemetry(int64_t period_ns) {
+    pthread_mutex_lock(&job_mutex);
+    int size = pool_size, idle = pool_idle, peak = pool_peak, depth = job_depth;
+    pool_peak = pool_size;
+    pthread_mutex_unlock(&job_mutex);
+
+    int64_t busy = atomic_exchange_explicit(&pool_busy_ns, 0, memory_order_relaxed);
+    uint64_t jobs = atomic_exchange_explicit(&jobs_dispatched, 0, memory_order_relaxed);
+    int64_t latency = atomic_exchange_explicit(&dispatch_latency_ns, 0, memory_order_relaxed);
+
+    // Utilisation เทียบกับความจุของขนาด Pool สูงสุดในช่วงนี้ (ประมาณการ)
+    double util = (peak > 0 && period_ns > 0) ? 100.0 * (double)busy / ((double)period_ns * peak) : 0.0;
+    printf("Monitor: Broadcaster pool %d (idle %d, peak %d, range %d-%d), utilisation %.1f%%, "
+           "queue depth %d, %llu jobs, avg dispatch latency %.3f ms\n",
+           size, idle, peak, config.pool_min, config.pool_max, util, depth,
+           (unsigned long long)jobs, jobs ? (double)latency / jobs / 1e6 : 0.0);
 }
 
 /**
  * @brief Thread สำหรับตรวจสอบ Client ที่ไม่มีการเคลื่อนไหวเกินกำหนด (Inactivity Timeout)
  */
 void* monitor_clients(void* arg) {
+    int64_t last_report = now_ns();
+
     while (1) {
         sleep(10); // ตรวจสอบทุก 10 วินาที
 
         // ต้องใช้ WRITE Lock ในการตรวจสอบ เพราะอาจมีการเรียก remove_client
-        pthread_rwlock_wrlock(&registry.rwlock); 
+        registry_write_lock(); 
         time_t now = time(NULL);
         
         for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (registry.clients[i].pid != 0) {
+            if (registry.clients[i].session_id != 0) {
                 // ตรวจสอบ Inactivity
                 if (difftime(now, registry.clients[i].last_active) > INACTIVITY_TIMEOUT) {
-                    printf("Monitor: Kicking client %d for inactivity.\n", registry.clients[i].pid);
+                    printf("Monitor: Kicking client %ld for inactivity.\n", registry.clients[i].session_id);
                     
                     // แจ้ง Client ก่อนถูกตัดการเชื่อมต่อ
                     Job* timeout_job = (Job*)malloc(sizeof(Job));
                     timeout_job->type = CMD_DM; 
                     timeout_job->target_qid = registry.clients[i].reply_qid;
+                    timeout_job->target_mtype = registry.clients[i].reply_mtype;
                     strcpy(timeout_job->sender_name, "SERVER");
                     strcpy(timeout_job->message, "You have been disconnected due to inactivity.");
                     add_job(timeout_job);
 
                     // ลบ Client ออกจาก Registry
-                    remove_client(registry.clients[i].pid);
+                    remove_client(registry.clients[i].session_id);
                 }
             }
         }
-        pthread_rwlock_unlock(&registry.rwlock);
+
+        // รายงาน Client ที่ถูกจำกัด (Throttled) ในช่วงที่ผ่านมา
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            uint64_t window = atomic_exchange_explicit(&rate_limits[i].throttled_window, 0, memory_order_relaxed);
+            if (window > 0 && registry.clients[i].session_id != 0) {
+                printf("Monitor: Client %ld throttled %llu times in last period (total %llu).\n",
+                       registry.clients[i].session_id, (unsigned long long)window,
+                       (unsigned long long)atomic_load_explicit(&rate_limits[i].throttled_total, memory_order_relaxed));
+            }
+        }
+        registry_write_unlock();
+
+        report_pool_telemetry(now_ns() - last_report);
+        int capacity = atomic_load_explicit(&ctrl_queue_capacity, memory_order_relaxed);
+        if (capacity > 0) {
+            printf("Monitor: Control Queue capacity %d messages, peak occupancy %d%%.\n", capacity,
+                   atomic_exchange_explicit(&ctrl_queue_peak_pct, 0, memory_order_relaxed));
+        }
+        printf("Monitor: Replies dropped on full queues so far: %llu.\n",
+               (unsigned long long)atomic_load_explicit(&reply_drops, memory_order_relaxed));
+        printf("Monitor: Registry seqlock reads that fell back to the read lock: %llu.\n",
+               (unsigned long long)atomic_load_explicit(&registry_seq_fallbacks, memory_order_relaxed));
+        printf("Monitor: Health evictions so far: %llu dead, %llu slow.\n",
+               (unsigned long long)atomic_load_explicit(&evicted_dead, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&evicted_slow, memory_order_relaxed));
+        last_report = now_ns();
     }
     return NULL;
 }
 
 
+// --- Client Health (Dead / Slow Consumer Detection) ---
+// ไม่ต้องรอ INACTIVITY_TIMEOUT: Client ที่รับข้อความไม่ได้จะถูก Evict ทันทีที่ตรวจพบ
+// 1. Broadcaster เจอ EIDRM => ทำเครื่องหมาย dead, Fan-out ข้าม Slot นั้น และปลุก Health Thread
+// 2. Health Thread ตรวจทุก health_interval_ms: kill(pid, 0) และ transport->probe() (IPC_STAT: msg_qnum, msg_rtime)
+
+/**
+ * @brief ทำเครื่องหมายว่า Client ตายแล้วและปลุก Health Thread (เรียกได้ขณะถือ READ Lock)
+ */
+void health_mark_dead(int client_idx) {
+    if (atomic_exchange_explicit(&client_health[client_idx].dead, 1, memory_order_relaxed)) return;
+    pthread_mutex_lock(&health_mutex);
+    health_wakeup = 1;
+    pthread_cond_signal(&health_cond);
+    pthread_mutex_unlock(&health_mutex);
+}
+
+/**
+ * @brief เหมือน health_mark_dead แต่ค้นหา Client จาก reply_qid (สำหรับงานที่ส่งไปยัง QID เดียว)
+ */
+void health_mark_dead_qid(int reply_qid) {
+    pthread_rwlock_rdlock(&registry.rwlock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // ทุก Session ที่ใช้คิวเดียวกันตายพร้อมกัน
+        if (registry.clients[i].session_id != 0 && registry.clients[i].reply_qid == reply_qid) {
+            health_mark_dead(i);
+        }
+    }
+    pthread_rwlock_unlock(&registry.rwlock);
+}
+
+/**
+ * @brief ตรวจสุขภาพของ Client ทุกคนและ Evict ตัวที่รับข้อความไม่ได้
+ * @details Syscall ตรวจสอบทำนอก Lock (ใช้ Snapshot) แล้วค่อยถือ WRITE Lock ตอน Evict
+ */
+static void health_sweep() {
+    SessionId sessions[MAX_CLIENTS];
+    pid_t pids[MAX_CLIENTS];
+    int qids[MAX_CLIENTS];
+    const char* reasons[MAX_CLIENTS];
+
+    pthread_rwlock_rdlock(&registry.rwlock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        sessions[i] = registry.clients[i].session_id;
+        pids[i] = registry.clients[i].pid;
+        qids[i] = registry.clients[i].reply_qid;
+    }
+    pthread_rwlock_unlock(&registry.rwlock);
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        EndpointStats st;
+        reasons[i] = NULL;
+        if (sessions[i] == 0) continue;
+
+        if (atomic_load_explicit(&client_health[i].dead, memory_order_relaxed)) {
+            reasons[i] = "reply queue removed";
+        } else if (kill(pids[i], 0) == -1 && errno == ESRCH) {
+            reasons[i] = "process exited";
+        } else {
+            int err = transport->probe(qids[i], &st);
+            if (err == EIDRM) {
+                reasons[i] = "reply queue removed";
+            } else if (err == 0 && st.backlog >= config.slow_backlog && st.idle_ms >= config.slow_timeout_ms) {
+                reasons[i] = "not reading replies";
+            }
+        }
+    }
+
+    registry_write_lock();
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // Slot ต้องยังเป็น Client คนเดิม (อาจถูกลบ/ลงทะเบียนใหม่ระหว่างตรวจ)
+        if (reasons[i] == NULL || registry.clients[i].session_id != sessions[i] || registry.clients[i].reply_qid != qids[i]) continue;
+
+        printf("Health: Evicting client %ld (QID %d): %s.\n", sessions[i], qids[i], reasons[i]);
+        if (strcmp(reasons[i], "not reading replies") == 0) {
+            atomic_fetch_add_explicit(&evicted_slow, 1, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&evicted_dead, 1, memory_order_relaxed);
+        }
+        remove_client(sessions[i]);
+    }
+    registry_write_unlock();
+}
+
+/**
+ * @brief Thread สำหรับตรวจสุขภาพ Client เป็นระยะ หรือทันทีเมื่อ Broadcaster ตรวจพบ Client ที่ตาย
+ */
+void* health_thread(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&health_mutex);
+        if (!health_wakeup) {
+            int64_t deadline = now_ns() + (int64_t)config.health_interval_ms * 1000000;
+            struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+            pthread_cond_timedwait(&health_cond, &health_mutex, &ts);
+        }
+        health_wakeup = 0;
+        pthread_mutex_unlock(&health_mutex);
+
+        health_sweep();
+    }
+    return NULL;
+}
+
 // --- Server Initialization and Cleanup ---
+
+/**
+ * @brief อ่านค่าจำนวนเต็มจาก Environment Variable (ใช้ค่าเริ่มต้นหากไม่ได้กำหนด)
+ */
+static int env_int(const char* name, int def) {
+    const char* v = getenv(name);
+    return (v && *v) ? atoi(v) : def;
+}
+
+/**
+ * @brief โหลดค่าตั้งค่าของ Server จาก Environment Variables
+ * @details CHAT_MSG_RATE, CHAT_MSG_BURST, CHAT_CTRL_RATE, CHAT_CTRL_BURST,
+ * CHAT_MAX_DELAY_MS, CHAT_THROTTLE_ACTION (drop | delay | kick),
+ * CHAT_TRANSPORT (sysv | unix), CHAT_SOCKET_PATH,
+ * CHAT_POOL_MIN, CHAT_POOL_MAX, CHAT_POOL_GROW_DEPTH, CHAT_POOL_GROW_LATENCY_MS, CHAT_POOL_IDLE_MS,
+ * CHAT_PRESENCE_WINDOW_MS (0 = ไม่รวม Event),
+ * CHAT_HEALTH_INTERVAL_MS, CHAT_SLOW_BACKLOG, CHAT_SLOW_TIMEOUT_MS,
+ * CHAT_CAPTURE (ไฟล์ Trace สำหรับบันทึกคำสั่ง, ว่าง = ปิด),
+ * CHAT_CTRL_QUEUE_MSGS, CHAT_CTRL_QUEUE_MAX_MSGS, CHAT_REPLY_QUEUE_DEFAULT_MSGS, CHAT_REPLY_QUEUE_MAX_MSGS,
+ * CHAT_MAILBOX (ไฟล์ Offline Mailbox, "off" = ปิด),
+ * CHAT_ADMIN_NICK (ชื่อเล่นเดียวที่ส่ง ANNOUNCE ได้, ว่าง = ปิด ANNOUNCE)
+ */
+void load_config() {
+    const char* tp = getenv("CHAT_TRANSPORT");
+    const char* path = getenv("CHAT_SOCKET_PATH");
+    strncpy(config.transport, (tp && *tp) ? tp : DEFAULT_TRANSPORT, sizeof(config.transport) - 1);
+    strncpy(config.socket_path, (path && *path) ? path : DEFAULT_SOCKET_PATH, sizeof(config.socket_path) - 1);
+
+    config.msg_rate = env_int("CHAT_MSG_RATE", DEFAULT_MSG_RATE);
+    config.msg_burst = env_int("CHAT_MSG_BURST", DEFAULT_MSG_BURST);
+    config.ctrl_rate = env_int("CHAT_CTRL_RATE", DEFAULT_CTRL_RATE);
+    config.ctrl_burst = env_int("CHAT_CTRL_BURST", DEFAULT_CTRL_BURST);
+    config.max_delay_ms = env_int("CHAT_MAX_DELAY_MS", DEFAULT_MAX_DELAY_MS);
+
+    config.pool_min = env_int("CHAT_POOL_MIN", BROADCASTER_COUNT);
+    config.pool_max = env_int("CHAT_POOL_MAX", DEFAULT_POOL_MAX);
+    config.pool_grow_depth = env_int("CHAT_POOL_GROW_DEPTH", DEFAULT_POOL_GROW_DEPTH);
+    config.pool_grow_latency_ms = env_int("CHAT_POOL_GROW_LATENCY_MS", DEFAULT_POOL_GROW_LATENCY_MS);
+    config.pool_idle_ms = env_int("CHAT_POOL_IDLE_MS", DEFAULT_POOL_IDLE_MS);
+    config.presence_window_ms = env_int("CHAT_PRESENCE_WINDOW_MS", DEFAULT_PRESENCE_WINDOW_MS);
+    config.health_interval_ms = env_int("CHAT_HEALTH_INTERVAL_MS", DEFAULT_HEALTH_INTERVAL_MS);
+    config.slow_backlog = env_int("CHAT_SLOW_BACKLOG", DEFAULT_SLOW_BACKLOG);
+    config.slow_timeout_ms = env_int("CHAT_SLOW_TIMEOUT_MS", DEFAULT_SLOW_TIMEOUT_MS);
+    const char* mailbox = getenv("CHAT_MAILBOX");
+    if (mailbox == NULL) mailbox = DEFAULT_MAILBOX_PATH;
+    snprintf(config.mailbox_path, sizeof(config.mailbox_path), "%s", strcmp(mailbox, "off") == 0 ? "" : mailbox);
+    config.ctrl_queue_msgs = env_int("CHAT_CTRL_QUEUE_MSGS", DEFAULT_CTRL_QUEUE_MSGS);
+    config.ctrl_queue_max_msgs = env_int("CHAT_CTRL_QUEUE_MAX_MSGS", DEFAULT_CTRL_QUEUE_MAX_MSGS);
+    config.reply_queue_default_msgs = env_int("CHAT_REPLY_QUEUE_DEFAULT_MSGS", DEFAULT_REPLY_QUEUE_MSGS);
+    config.reply_queue_max_msgs = env_int("CHAT_REPLY_QUEUE_MAX_MSGS", DEFAULT_REPLY_QUEUE_MAX_MSGS);
+    if (config.ctrl_queue_msgs < MIN_QUEUE_MSGS) config.ctrl_queue_msgs = MIN_QUEUE_MSGS;
+    if (config.ctrl_queue_max_msgs < config.ctrl_queue_msgs) config.ctrl_queue_max_msgs = config.ctrl_queue_msgs;
+    if (config.reply_queue_max_msgs < MIN_QUEUE_MSGS) config.reply_queue_max_msgs = MIN_QUEUE_MSGS;
+    const char* capture = getenv("CHAT_CAPTURE");
+    snprintf(config.capture_path, sizeof(config.capture_path), "%s", capture ? capture : "");
+    const char* admin = getenv("CHAT_ADMIN_NICK");
+    snprintf(config.admin_nick, sizeof(config.admin_nick), "%s", admin && nick_valid(admin) ? admin : "");
+    if (config.pool_min < 1) config.pool_min = 1;
+    if (config.pool_max < config.pool_min) config.pool_max = config.pool_min;
+
+    const char* action = getenv("CHAT_THROTTLE_ACTION");
+    config.throttle_action = THROTTLE_DROP;
+    if (action && strcmp(action, "delay") == 0) config.throttle_action = THROTTLE_DELAY;
+    else if (action && strcmp(action, "kick") == 0) config.throttle_action = THROTTLE_KICK;
+
+    printf("Rate limits: MSG %d/s (burst %d), CTRL %d/s (burst %d), action: %s\n",
+           config.msg_rate, config.msg_burst, config.ctrl_rate, config.ctrl_burst,
+           config.throttle_action == THROTTLE_DELAY ? "delay" :
+           config.throttle_action == THROTTLE_KICK ? "kick" : "drop");
+}
+
 void init_server_state() {
     // กำหนดค่าเริ่มต้นของ Registry
     memset(&registry, 0, sizeof(GlobalRegistry));
@@ -660,6 +3479,18 @@ void init_server_state() {
         exit(EXIT_FAILURE);
     }
 
+    // Condition Variable ที่ใช้ timedwait ต้องใช้นาฬิกา Monotonic ให้ตรงกับ now_ns()
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&job_cond, &cattr);
+    pthread_cond_init(&delay_cond, &cattr);
+    pthread_cond_init(&presence_cond, &cattr);
+    pthread_cond_init(&health_cond, &cattr);
+    pthread_cond_init(&capture_cond, &cattr);
+    pthread_cond_init(&mailbox_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
     // สร้าง Channel เริ่มต้น
     strcpy(registry.rooms[0].channel_name, "#general");
     registry.room_count = 1;
@@ -667,58 +3498,118 @@ void init_server_state() {
 }
 
 /**
- * @brief ฟังก์ชันจัดการการปิด Server (SIGINT)
+ * @brief ปิด Control Endpoint ของ Transport ครั้งเดียว (Router จะได้ -1 จาก recv_command และจบ)
  */
-void cleanup(int sig) {
-    printf("\nServer shutting down. Removing server Control Queue...\n");
+static void stop_transport(void) {
+    if (atomic_exchange(&server_stopping, 1)) return;
+    if (transport) transport->shutdown();
+}
 
-    // 1. ลบ Control Queue เพื่อยุติ Router thread
-    if (control_qid != -1 && msgctl(control_qid, IPC_RMID, NULL) == 0) {
-        printf("Control Queue removed successfully.\n");
-    } else if (control_qid != -1 && errno != EIDRM) {
-        perror("Failed to remove Control Queue");
-    }
+/**
+ * @brief Thread รอสัญญาณปิด Server (SIGINT/SIGTERM) ด้วย sigwait
+ * @details สัญญาณถูก Block ในทุก Thread ตั้งแต่ต้น main จึงไม่มี Signal Handler ที่ขัดจังหวะ Thread ที่ถือ Lock อยู่
+ * Thread นี้ทำแค่ปิด Control Endpoint เพื่อให้ Router จบ ส่วนการปิดไฟล์ทำใน cleanup() บน Main Thread
+ */
+void* signal_thread(void* arg) {
+    const sigset_t* set = (const sigset_t*)arg;
+    int sig;
+    if (sigwait(set, &sig) != 0) return NULL;
+    printf("\nServer shutting down (%s). Removing server Control Endpoint...\n",
+           sig == SIGTERM ? "SIGTERM" : "SIGINT");
+    stop_transport();
+    return NULL;
+}
 
-    // 2. ทำลาย Lock และ Condition Variable
-    pthread_rwlock_destroy(&registry.rwlock);
-    pthread_mutex_destroy(&job_mutex);
-    pthread_cond_destroy(&job_cond);
+/**
+ * @brief ปิด Server: หยุดรับคำสั่ง รอ Router จบ แล้ว join Capture/Mailbox Thread และปิดไฟล์
+ * @details เรียกจาก Main Thread เท่านั้น (ไม่ใช่ Signal Context) Broadcaster/Monitor/Health Thread ยังทำงานอยู่
+ * จึงไม่ทำลาย Lock ที่ Thread เหล่านั้นใช้ ให้ exit() คืนทรัพยากรทั้งหมดแทน
+ */
+void cleanup() {
+    stop_transport();
+    if (router_running) {
+        pthread_join(router_tid, NULL);
+        router_running = 0;
+    }
 
-    exit(EXIT_SUCCESS);
+    // Router หยุดแล้ว: ไม่มีใครเติม Capture Buffer หรือเขียน Mailbox เพิ่ม
+    capture_close();
+    mailbox_close();
 }
 
 int main() {
-    pthread_t router_tid;
-    pthread_t broadcaster_tids[BROADCASTER_COUNT];
+    pthread_t signal_tid;
     pthread_t monitor_tid;
+    pthread_t delay_tid;
+    pthread_t presence_tid;
+    pthread_t health_tid;
+    pthread_t mailbox_tid;
+
+    // Block SIGINT/SIGTERM ก่อนสร้าง Thread ใดๆ (Thread ลูกสืบทอด Mask) แล้วรับสัญญาณด้วย sigwait ใน Signal Thread
+    sigset_t stop_set;
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, NULL);
+    if (pthread_create(&signal_tid, NULL, signal_thread, &stop_set) != 0) {
+        perror("pthread_create (signal)");
+        exit(EXIT_FAILURE);
+    }
 
-    signal(SIGINT, cleanup); 
-
+    load_config();
     init_server_state();
 
-    // 1. สร้าง Control Queue ของ Server
-    control_qid = msgget(CONTROL_QUEUE_KEY, IPC_CREAT | 0666);
-    if (control_qid == -1) {
-        perror("msgget (server)");
-        cleanup(0);
+    // 1. สร้าง Control Endpoint ของ Server ตาม Transport ที่เลือก
+    transport = strcmp(config.transport, "unix") == 0 ? &sock_transport : &sysv_transport;
+    if (transport->init() == -1) {
+        cleanup();
         exit(EXIT_FAILURE);
     }
 
-    printf("Chatroom Server started (Control QID: %d).\n", control_qid);
-    printf("Architecture: Router + %d Broadcaster Threads + Monitor Thread (Timeout: %d secs).\n", BROADCASTER_COUNT, INACTIVITY_TIMEOUT);
+    printf("Chatroom Server started (Transport: %s).\n", transport->name);
+    printf("Architecture: Router + %d-%d Broadcaster Threads (elastic) + Monitor Thread (Timeout: %d secs).\n",
+           config.pool_min, config.pool_max, INACTIVITY_TIMEOUT);
+
+    // เปิดไฟล์ Trace และ Capture Thread ก่อน Router เริ่มรับคำสั่ง (ถ้าเปิดใช้)
+    if (config.capture_path[0] != '\0') {
+        if (capture_open() == -1 || pthread_create(&capture_tid, NULL, capture_thread, NULL) != 0) {
+            if (capture_file) fclose(capture_file);
+            capture_file = NULL;
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // เปิด Offline Mailbox และ Mailbox Thread (หากเปิดไม่ได้ Server ทำงานต่อโดยไม่เก็บ DM)
+    if (config.mailbox_path[0] != '\0' && mailbox_open() == 0 &&
+        pthread_create(&mailbox_tid, NULL, mailbox_thread, NULL) != 0) {
+        perror("pthread_create (mailbox)");
+        mailbox_close();
+    } else if (mailbox_enabled) {
+        mailbox_running = 1;
+    }
+    if (config.admin_nick[0] != '\0') {
+        // ชื่อ Admin ถูกจองด้วย Key ผ่าน Mailbox เท่านั้น หากปิด Mailbox ใครก็ตั้งชื่อนี้ได้ตอน Admin ออฟไลน์
+        printf("Announce: Restricted to nickname %s%s.\n", config.admin_nick,
+               mailbox_enabled ? "" : " (WARNING: mailbox is off, so the name is not reserved)");
+    }
 
     // 2. เริ่ม Router Thread
     if (pthread_create(&router_tid, NULL, (void* (*)(void*))router_thread, NULL) != 0) {
         perror("pthread_create (router)");
-        cleanup(0);
+        cleanup();
         exit(EXIT_FAILURE);
     }
-
-    // 3. เริ่ม Broadcaster Pool
-    for (int i = 0; i < BROADCASTER_COUNT; i++) {
-        if (pthread_create(&broadcaster_tids[i], NULL, broadcaster_thread, (void*)(intptr_t)i) != 0) {
-            perror("pthread_create (broadcaster)");
-            cleanup(0);
+    router_running = 1;
+
+    // 3. เริ่ม Broadcaster Pool ที่ขนาดขั้นต่ำ (ขยาย/หดเองตามโหลด)
+    for (int i = 0; i < config.pool_min; i++) {
+        pthread_mutex_lock(&job_mutex);
+        pool_size++;
+        pool_peak = pool_size;
+        pthread_mutex_unlock(&job_mutex);
+        if (pool_spawn_worker() != 0) {
+            cleanup();
             exit(EXIT_FAILURE);
         }
     }
@@ -726,12 +3617,35 @@ int main() {
     // 4. เริ่ม Monitor Thread (สำหรับ Inactivity Timeout)
     if (pthread_create(&monitor_tid, NULL, monitor_clients, NULL) != 0) {
         perror("pthread_create (monitor)");
-        cleanup(0);
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    // 5. เริ่ม Delay Thread (สำหรับคำสั่งที่ถูกหน่วงด้วย Rate Limit)
+    if (pthread_create(&delay_tid, NULL, delay_thread, NULL) != 0) {
+        perror("pthread_create (delay)");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    // 6. เริ่ม Presence Thread (ส่ง Join/Leave Digest)
+    if (pthread_create(&presence_tid, NULL, presence_thread, NULL) != 0) {
+        perror("pthread_create (presence)");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    // 7. เริ่ม Health Thread (ตรวจจับ Client ที่ตาย/ไม่อ่านข้อความ)
+    if (pthread_create(&health_tid, NULL, health_thread, NULL) != 0) {
+        perror("pthread_create (health)");
+        cleanup();
         exit(EXIT_FAILURE);
     }
 
-    // รอ Router thread จบ (เมื่อ Control Queue ถูกลบใน cleanup)
+    // รอ Router thread จบ (เมื่อ Signal Thread ปิด Control Endpoint) แล้วปิดไฟล์บน Main Thread
     pthread_join(router_tid, NULL);
+    router_running = 0;
+    cleanup();
 
     return 0; 
 }
\ No newline at end of file
@@ -4,19 +4,81 @@
 #include <sys/types.h>
 #include <pthread.h>
 #include <time.h> // สำหรับ time_t
+#include <stdint.h>
+#include <stdatomic.h>
 
 // --- IPC Keys & Types ---
 #define CONTROL_QUEUE_KEY 1234
-#define BROADCASTER_COUNT 4     // จำนวน worker thread ใน pool
+#define BROADCASTER_COUNT 4     // จำนวน worker thread ขั้นต่ำใน pool (ค่าเริ่มต้นของ CHAT_POOL_MIN)
 #define MAX_TEXT_SIZE 256
 #define MAX_CHANNEL 32
 #define MAX_USERNAME 32
 #define MAX_CLIENTS 10          
 #define MAX_CHANNELS 5          
+#define MAX_CHANNEL_LIST (MAX_CHANNELS * MAX_CHANNEL) // รายชื่อ Channel ของ MULTICAST ("#a,#b,..." รวม '\0') ใส่ได้ครบทุกห้อง
 #define INACTIVITY_TIMEOUT 120 // 120 วินาที (2 นาที)
+#define REGISTRY_SEQ_RETRIES 8  // Seqlock Reader ลองอ่านซ้ำได้เท่านี้ก่อนถอยไปใช้ READ Lock
+
+// --- Adaptive Broadcaster Pool (ค่าเริ่มต้น, เปลี่ยนได้ด้วย Environment Variable) ---
+#define DEFAULT_POOL_MAX 16             // จำนวน worker สูงสุด
+#define DEFAULT_POOL_GROW_DEPTH 32      // ขยาย Pool เมื่องานค้างเกินเท่านี้
+#define DEFAULT_POOL_GROW_LATENCY_MS 20 // หรือเมื่องานรอในคิวนานเกินเท่านี้
+#define DEFAULT_POOL_IDLE_MS 30000      // Worker ที่ว่างนานเกินเท่านี้จะถูกปลด (ถ้าเกินขนาดขั้นต่ำ)
+
+// --- Presence Coalescing (Join/Leave Digest) ---
+#define DEFAULT_PRESENCE_WINDOW_MS 250  // รวม Event เข้า/ออกห้องภายในช่วงนี้เป็นข้อความเดียว
+#define PRESENCE_SAMPLE 5               // จำนวนชื่อสูงสุดที่แสดงใน Digest
+
+// --- Client Health (ตรวจจับ Client ที่ตาย/ไม่อ่านข้อความ) ---
+#define DEFAULT_HEALTH_INTERVAL_MS 2000 // ตรวจ kill(pid, 0) และสถานะ Reply Queue ทุกช่วงนี้
+#define DEFAULT_SLOW_BACKLOG 32         // ข้อความค้างตั้งแต่เท่านี้ขึ้นไป...
+#define DEFAULT_SLOW_TIMEOUT_MS 5000    // ...และไม่มีการอ่านนานเท่านี้ = Slow Consumer (ถูก Evict)
+
+// --- Kernel Queue Capacity (msg_qbytes คิดเป็นจำนวนข้อความ, ตั้งด้วย msgctl(IPC_SET)) ---
+#define DEFAULT_CTRL_QUEUE_MSGS 512       // ความจุเริ่มต้นของ Control Queue
+#define DEFAULT_CTRL_QUEUE_MAX_MSGS 4096  // Control Queue ขยายตัวเองได้ถึงเท่านี้เมื่อใช้งานเกิน CTRL_QUEUE_HIGH_WATER
+#define CTRL_QUEUE_HIGH_WATER 75          // % ของความจุที่ถือว่าใกล้เต็ม
+#define CTRL_QUEUE_SAMPLE 64              // ตรวจ IPC_STAT ทุกๆ N คำสั่งที่ Router อ่าน
+#define DEFAULT_REPLY_QUEUE_MSGS 128      // ความจุ Reply Queue ที่แนะนำเมื่อ Client ไม่ได้ขอ
+#define DEFAULT_REPLY_QUEUE_MAX_MSGS 1024 // ความจุสูงสุดที่ Client ขอได้
+#define MIN_QUEUE_MSGS 16
+#define REPLY_QUEUE_HINT "Reply queue: "  // ข้อความใน Welcome: ค่าที่ Server เสนอ (Client รายงานค่าที่ตั้งได้จริงเอง)
+
+// --- Transport (เลือกตอนรันด้วย CHAT_TRANSPORT ทั้ง Server และ Client) ---
+#define DEFAULT_TRANSPORT "sysv"                 // "sysv" (System V Message Queue) หรือ "unix" (Unix Domain Socket)
+#define DEFAULT_SOCKET_PATH "/tmp/ipc_chat.sock" // ใช้เมื่อ CHAT_TRANSPORT=unix (เปลี่ยนได้ด้วย CHAT_SOCKET_PATH)
+#define SOCK_MAX_CONNS 1024     // จำนวน Connection สูงสุดของ Backend unix (ต้องไม่เกิน 65535)
+#define SOCK_OUTBOX_SIZE 64     // จำนวน Frame ที่ค้างส่งได้ต่อ Connection ก่อนเริ่ม Drop
+#define SOCK_SEND_BATCH 16      // จำนวน Frame สูงสุดต่อ sendmmsg 1 ครั้ง
+#define SOCK_EPOLL_EVENTS 64    // จำนวน Event สูงสุดต่อ epoll_wait 1 ครั้ง
+
+// --- Admission Control (Token Bucket ต่อ Client) ---
+// ค่าเริ่มต้น: เปลี่ยนได้ตอนรัน Server ผ่าน Environment Variable (ดู load_config() ใน main.c)
+#define DEFAULT_MSG_RATE 20         // CMD_MSG/CMD_DM ต่อวินาที
+#define DEFAULT_MSG_BURST 40        // จำนวน Token สูงสุดของ Bucket ข้อความ
+#define DEFAULT_CTRL_RATE 5         // คำสั่งควบคุม (JOIN/WHO/LEAVE) ต่อวินาที
+#define DEFAULT_CTRL_BURST 10       // จำนวน Token สูงสุดของ Bucket คำสั่งควบคุม
+#define DEFAULT_MAX_DELAY_MS 2000   // โหมด delay: หน่วงได้นานสุดเท่านี้ ถ้าเกินจะ drop แทน
 
 #define MSG_TYPE_COMMAND 1L     // Message type สำหรับคำสั่ง (Client -> Router)
-#define MSG_TYPE_BROADCAST 2L   // Message type สำหรับข้อความตอบกลับ/กระจาย (Broadcaster -> Client)
+// Reply Queue ใช้ mtype แยกตาม Priority: ค่าน้อย = ด่วนกว่า
+// Client อ่านด้วย msgrcv(..., -MSG_TYPE_BROADCAST, ...) เพื่อให้ได้ข้อความด่วนก่อนเสมอ
+#define MSG_TYPE_REPLY 2L       // Message type สำหรับข้อความตอบกลับแบบ Interactive (DM, ยืนยัน, Error, Welcome)
+#define MSG_TYPE_BROADCAST 3L   // Message type สำหรับข้อความกระจายในห้อง (Bulk fan-out)
+
+#define BULK_STARVATION_LIMIT 8 // จำนวนงาน Interactive สูงสุดที่ทำติดกันก่อนบังคับให้ทำงาน Bulk 1 งาน
+
+// --- Logical Sessions ---
+// Client ปกติใช้ PID ของตัวเองเป็น Session ID (session_id ในคำสั่ง = 0)
+// Gateway/Bot ที่แทนผู้ใช้หลายคนลงทะเบียนได้หลาย Session บน Reply Queue เดียว:
+// แต่ละ Session ใช้ Session ID ของตัวเองเป็น mtype ของข้อความตอบกลับ (ต้องมากกว่า MSG_TYPE_BROADCAST)
+typedef long SessionId;
+// Session ID ของ Gateway มีบิต SESSION_ID_GATEWAY_BIT เสมอ จึงไม่มีวันเท่ากับ PID จริง (pid_max <= 2^22)
+#define SESSION_ID_STRIDE 1000L                  // Session ID ของ Client = GATEWAY_BIT | (PID * STRIDE + ลำดับ 1..STRIDE-1)
+#define SESSION_ID_GATEWAY_BIT (1L << 40)
+#define MAKE_SESSION_ID(pid, n) (SESSION_ID_GATEWAY_BIT | ((SessionId)(pid) * SESSION_ID_STRIDE + (n)))
+#define SESSION_ID_OWNER(id) ((pid_t)(((id) & ~SESSION_ID_GATEWAY_BIT) / SESSION_ID_STRIDE)) // PID ที่สร้าง Session นี้
+#define MAX_GATEWAY_SESSIONS 64                  // จำนวน Logical Session สูงสุดต่อ Client 1 ตัว (CHAT_SESSIONS)
 
 // --- Command Codes (กำหนดโดย Client) ---
 typedef enum {
@@ -27,54 +89,235 @@ typedef enum {
     CMD_WHO,
     CMD_LEAVE,
     CMD_QUIT,
+    CMD_SUB,   // Subscribe Topic Pattern (channel = "#ops.alerts.db", "#ops.*", "#ops.**")
+    CMD_UNSUB,
+    CMD_PUB,   // Publish ไปยัง Topic (channel = Topic ที่ไม่มี Wildcard)
+    CMD_MULTICAST, // ส่งข้อความเดียวไปหลายห้อง (target = "#a,#b,...") ผู้รับที่อยู่หลายห้องได้รับครั้งเดียว
+    CMD_ANNOUNCE,  // ส่งข้อความไปยัง Client ทุกคน
+    CMD_NICK,      // ตั้ง/เปลี่ยนชื่อเล่น (target = ชื่อใหม่) ใช้เป็นปลายทางของ DM แทน PID ได้
+    CMD_MAIL,      // ใช้ภายใน Server เท่านั้น: Job ส่งจดหมายจาก Offline Mailbox (Client ส่งมาจะถูกทิ้ง)
 } CommandCode;
 
+// --- End-to-end Latency Stamps (CLOCK_MONOTONIC, นาโนวินาที; 0 = ไม่มีข้อมูล) ---
+// CLOCK_MONOTONIC ใช้ร่วมกันทั้งเครื่อง จึงเทียบเวลาระหว่าง Process ของ Client และ Server ได้
+typedef struct {
+    int64_t client_send_ns;  // Client เรียก send_command
+    int64_t router_recv_ns;  // Router อ่านคำสั่งออกจาก Control Queue / Socket
+    int64_t job_enqueue_ns;  // Handler ใส่ Job ลง Job Queue
+    int64_t dispatch_ns;     // Broadcaster หยิบ Job ออกมาส่ง
+} LatencyStamps;
+
 // --- Message Structure (Client -> Router) ---
 typedef struct {
     long mtype;             // ต้องเป็น MSG_TYPE_COMMAND (1)
     CommandCode command;
     pid_t sender_pid;       // PID ของ Client
     int reply_qid;          // ID คิวส่วนตัวของ Client (สำคัญมาก)
+    SessionId session_id;   // 0 = ใช้ sender_pid, อื่นๆ = Logical Session (ตอบกลับด้วย mtype นี้)
+    LatencyStamps stamps;   // Client ใส่ client_send_ns, Router ใส่ router_recv_ns
     char channel[MAX_CHANNEL]; // Channel เป้าหมายสำหรับ JOIN/MSG/WHO
-    char target[MAX_USERNAME]; // Target PID string สำหรับ DM
+    char target[MAX_USERNAME]; // Target PID string สำหรับ DM, ความจุ Reply Queue ที่ขอ (ข้อความ) สำหรับ REGISTER
+    char channels[MAX_CHANNEL_LIST]; // รายชื่อ Channel คั่นด้วย ',' สำหรับ MULTICAST (คำสั่งอื่นเป็นค่าว่าง)
     char text[MAX_TEXT_SIZE];  // เนื้อหาข้อความ
 } CommandMessage;
 
 // --- Message Structure (Broadcaster -> Client) ---
 typedef struct {
-    long mtype;             // ต้องเป็น MSG_TYPE_BROADCAST (2)
+    long mtype;             // MSG_TYPE_REPLY (2), MSG_TYPE_BROADCAST (3) หรือ Session ID ของ Logical Session
+    LatencyStamps stamps;   // Stamp ของคำสั่งต้นทาง (ข้อความจาก Server เองเป็น 0)
+    int queue_capacity;     // > 0 เฉพาะ Welcome จาก Server: ความจุ Reply Queue (ข้อความ) ที่ตกลงกันแล้ว
     char sender[MAX_USERNAME]; // ชื่อผู้ส่งที่ถูกจัดรูปแบบแล้ว (เช่น "[#room] User 12345")
     char text[MAX_TEXT_SIZE];  // เนื้อหาข้อความ
 } ReplyMessage;
 
+// --- Job Priority Classes ---
+// ลำดับใน enum คือลำดับความสำคัญ (ค่าน้อย = ทำก่อน)
+typedef enum {
+    JOB_PRIO_INTERACTIVE,   // ตอบกลับ Client รายคน (DM, ยืนยัน, Error)
+    JOB_PRIO_BULK,          // Broadcast ไปทั้งห้อง
+    JOB_PRIO_COUNT
+} JobPriority;
+
+// --- Topic Subscriptions (Hierarchical Topic + Wildcard, Index ด้วย Trie) ---
+// Topic = "#seg1.seg2..." Pattern ใช้ "*" แทน 1 Segment และ "**" (ต้องเป็น Segment สุดท้าย) แทน 0 Segment ขึ้นไป
+#define TOPIC_MAX_DEPTH 8           // จำนวน Segment สูงสุดของ Topic/Pattern
+#define TOPIC_MAX_NODES 256         // จำนวน Node สูงสุดของ Trie
+#define MAX_SUBSCRIPTIONS 8         // จำนวน Pattern สูงสุดต่อ Client
+#define TOPIC_CACHE_SIZE 64         // Cache ผลการ Match (Topic -> Slot Mask), Direct-mapped
+
+// --- Nicknames (Directory แบบ Hash Table, Open Addressing) ---
+// ชื่อต้องขึ้นต้นด้วยตัวอักษร (แยกจาก Session ID ที่เป็นตัวเลข) ตามด้วยตัวอักษร/ตัวเลข/'_'/'-'
+#define NICK_MAX_LEN 15             // ความยาวสูงสุด (ให้ "[#channel] <nick>" พอดีกับ sender_name)
+#define NICK_TABLE_SIZE 64          // จำนวน Bucket (ต้องเป็นกำลังของ 2 และมากกว่า MAX_CLIENTS)
+
+// ปลายทางที่ Resolve แล้วของงาน Fan-out แบบระบุผู้รับ (CMD_PUB, CMD_MULTICAST, CMD_ANNOUNCE)
+typedef struct {
+    int qid;
+    long mtype;
+    int slot;               // Client Slot (ใช้ข้ามผู้รับที่ถูกทำเครื่องหมาย dead แล้ว)
+} JobTarget;
+
 // --- Broadcaster Job Structure ---
 // โครงสร้างงานที่ Router ส่งให้ Broadcaster Pool
 typedef struct Job {
     CommandCode type;
+    JobPriority priority;           // กำหนดโดย add_job() ตามประเภทงาน
+    LatencyStamps stamps;           // Stamp ของคำสั่งต้นทาง + เวลาเข้าคิว (ใช้วัด Latency เพื่อขยาย Pool ด้วย)
     char sender_name[MAX_USERNAME]; // ชื่อผู้ส่งที่ใช้แสดงผล
     char target_channel[MAX_CHANNEL]; // Channel ที่ต้อง Broadcast
     int target_qid;                 // Specific QID สำหรับ DM หรือ Reply
+    long target_mtype;              // mtype ของ Session ปลายทาง (0 = ใช้ Priority Lane ปกติ)
+    int queue_capacity;             // CMD_REGISTER (Welcome): ความจุ Reply Queue ที่ตกลงแล้ว ส่งใน ReplyMessage.queue_capacity
+    uint64_t mail_offset;           // CMD_MAIL: Offset ของจดหมายใน Mailbox (Broadcaster แจ้งผลการส่งกลับด้วย mailbox_sent)
+    JobTarget targets[MAX_CLIENTS]; // CMD_PUB/MULTICAST/ANNOUNCE: ผู้รับที่ Resolve (ตัดซ้ำ) แล้ว (ไม่ต้องแตะ Registry ตอนส่ง)
+    int target_count;
     char message[MAX_TEXT_SIZE];
     struct Job *next;
 } Job;
 
+// --- Server Configuration ---
+
+// การตอบสนองเมื่อ Client ใช้ Token หมด
+typedef enum {
+    THROTTLE_DROP,          // ทิ้งคำสั่ง
+    THROTTLE_DELAY,         // เลื่อนคำสั่งออกไปจนกว่าจะมี Token (ไม่บล็อก Router)
+    THROTTLE_KICK,          // ตัดการเชื่อมต่อ Client
+} ThrottleAction;
+
+typedef struct {
+    char transport[16];             // "sysv" | "unix"
+    char socket_path[108];          // ขนาดเท่ากับ sun_path
+    int msg_rate, msg_burst;
+    int ctrl_rate, ctrl_burst;
+    int max_delay_ms;
+    ThrottleAction throttle_action;
+    int pool_min, pool_max;
+    int pool_grow_depth, pool_grow_latency_ms, pool_idle_ms;
+    int presence_window_ms;
+    int health_interval_ms, slow_backlog, slow_timeout_ms;
+    char capture_path[256];         // "" = ไม่ Capture
+    int ctrl_queue_msgs, ctrl_queue_max_msgs;
+    int reply_queue_default_msgs, reply_queue_max_msgs; // ค่าที่เสนอเมื่อ Client ไม่ได้ขอ, ค่าสูงสุดที่ขอได้
+    char mailbox_path[256];         // "" = ปิด Offline Mailbox
+    char admin_nick[NICK_MAX_LEN + 1]; // ชื่อเล่นที่ส่ง ANNOUNCE ได้ ("" = ปิด ANNOUNCE)
+} ServerConfig;
+
+// --- Admission Control State (Lock-free, ต่อ Slot) ---
+
+// Token Bucket: เก็บ Token เป็นหน่วย 1/1000 เพื่อให้ Refill ละเอียดโดยไม่ใช้ float
+// tokens ติดลบได้ในโหมด delay (เป็น "หนี้" ที่ต้องรอจ่ายคืน)
+typedef struct {
+    _Atomic int64_t tokens_milli;
+    _Atomic int64_t last_refill_ns;
+} TokenBucket;
+
+typedef struct {
+    TokenBucket msg;                // งบประมาณของ CMD_MSG / CMD_DM
+    TokenBucket ctrl;               // งบประมาณของ JOIN / WHO / LEAVE
+    _Atomic uint64_t throttled_total;  // จำนวนคำสั่งที่ถูกจำกัดทั้งหมดของ Slot นี้
+    _Atomic uint64_t throttled_window; // จำนวนคำสั่งที่ถูกจำกัดตั้งแต่รายงานครั้งก่อน
+} RateLimitSlot;
+
+// --- Traffic Capture (รูปแบบไฟล์ Trace ที่ใช้ร่วมกันระหว่าง Server และ replay.c) ---
+// ไฟล์ = TRACE_MAGIC (8 ไบต์) ตามด้วย Record ต่อกันไปเรื่อยๆ
+// แต่ละ Record = TraceRecord ตามด้วย channel, target, channels, text (ความยาวตาม Header, ไม่มี '\0')
+#define TRACE_MAGIC "IPCTRC02"      // 02 = มี channels (รายชื่อ Channel ของ MULTICAST)
+#define TRACE_MAGIC_LEN 8
+#define CAPTURE_BUFFER_SIZE 65536   // ขนาด Buffer แต่ละฝั่ง (Router เขียนฝั่งหนึ่ง Writer Thread เขียนลงไฟล์อีกฝั่ง)
+
+typedef struct __attribute__((packed)) {
+    uint64_t t_ns;          // เวลาที่ Router รับคำสั่ง นับจากเริ่ม Capture
+    int32_t sender_pid;
+    int32_t reply_qid;
+    int64_t session_id;
+    uint8_t command;
+    uint8_t channel_len;
+    uint8_t target_len;
+    uint8_t channels_len;
+    uint16_t text_len;
+} TraceRecord;
+
+// --- Offline Mailbox (DM ถึงผู้ใช้ที่ไม่ออนไลน์, เก็บในไฟล์ mmap แบบ Append-only) ---
+// ไฟล์ = MailboxHeader ตามด้วย MailRecord + text (จัด Alignment 8 ไบต์) ต่อกันไปเรื่อยๆ
+// Record ของผู้รับคนเดียวกันเชื่อมกันด้วย next (Offset ในไฟล์) ส่วน Index อยู่ในหน่วยความจำและสร้างใหม่ตอนเปิดไฟล์
+// ผู้รับระบุด้วยชื่อเล่น และรับจดหมายได้เฉพาะชื่อที่มี Index Entry (เคยมี Client ใช้ชื่อนี้ หรือยังมีจดหมายค้าง)
+// ชื่อที่มี Entry ถูกจองให้เจ้าของเดิม: ตั้งชื่อนี้อีกได้ด้วย Key ที่ได้รับตอนตั้งครั้งแรกเท่านั้น
+#define DEFAULT_MAILBOX_PATH "/tmp/ipc_chat_mailbox.dat" // CHAT_MAILBOX=<path>, "off" = ปิด
+#define MAILBOX_MAGIC "IPCMBX03"     // 03 = Record มี owner_key (02 = ไม่มี, 01 = ผู้รับเป็น Session ID)
+#define MAILBOX_INITIAL_SIZE (1 << 20)  // ขนาดไฟล์เริ่มต้น (ขยายทีละ 2 เท่าด้วย mremap)
+#define MAILBOX_INDEX_SIZE 1024         // จำนวนชื่อเล่นที่รับจดหมายได้สูงสุด (Open Addressing, ต้องเป็นกำลังของ 2)
+#define MAILBOX_MAX_PER_USER 64         // จำนวนจดหมายค้างสูงสุดต่อผู้รับ
+#define MAILBOX_SEEN_TTL (30 * 24 * 3600) // ชื่อที่ไม่ได้ใช้นานเกินนี้ (วินาที) และไม่มีจดหมายค้าง ถูกลบจาก Index
+#define MAILBOX_FLUSH_BATCH 16          // จำนวนจดหมายที่ส่งต่อ 1 รอบตอน Flush
+#define MAILBOX_FLUSH_PAUSE_MS 20       // พักระหว่างรอบเพื่อให้ Client อ่าน Reply Queue ทัน
+#define MAILBOX_COMPACT_MIN (64 * 1024) // Compact เมื่อพื้นที่ที่ส่งแล้วเกินเท่านี้...
+#define MAILBOX_COMPACT_CHECK_MS 5000   // ...และเกินครึ่งของไฟล์ (ตรวจทุกช่วงนี้และหลัง Flush)
+
+// สถานะของ MailRecord.delivered
+#define MAIL_PENDING 0              // ค้างอยู่ใน Chain ของผู้รับ
+#define MAIL_DELIVERED 1            // ส่งถึง Reply Queue ของผู้รับแล้ว
+#define MAIL_SENDING 2              // อยู่ใน Job Queue รอ Broadcaster แจ้งผล (ส่งไม่สำเร็จ = กลับเป็น MAIL_PENDING)
+
+typedef struct {
+    char magic[8];
+    uint64_t used;          // Offset สิ้นสุดของ Log (Record ถัดไปเขียนที่นี่)
+} MailboxHeader;
+
+typedef struct {
+    uint64_t next;          // Offset ของจดหมายถัดไปของผู้รับคนเดียวกัน (0 = ฉบับสุดท้าย)
+    int64_t stored_at;      // time(NULL) ตอนที่เก็บ
+    uint64_t owner_key;     // Key ของเจ้าของชื่อตอนเก็บ (คืนให้ Index ตอนเปิดไฟล์ ชื่อจึงยังถูกจองหลัง Restart)
+    char recipient[NICK_MAX_LEN + 1]; // ชื่อเล่นของผู้รับ (Session ID ถูกใช้ซ้ำได้ จึงไม่ใช้เป็น Key)
+    char sender[NICK_MAX_LEN + 1];    // ชื่อเล่นของผู้ส่ง หรือ Session ID (ตัวเลข) หากไม่ได้ตั้งชื่อ
+    uint16_t text_len;
+    uint8_t delivered;      // MAIL_PENDING / MAIL_SENDING / MAIL_DELIVERED (พื้นที่ของที่ส่งแล้วถูกคืนตอน Compact)
+    uint8_t reserved[5];
+} MailRecord;
+
+typedef struct {
+    char recipient[NICK_MAX_LEN + 1]; // "" = ช่องว่าง
+    uint64_t head, tail;    // Offset ของจดหมายฉบับแรก/สุดท้ายที่ยังไม่ได้ส่ง
+    uint32_t count;
+    int retry;              // 1 = มีจดหมายที่ส่งไม่สำเร็จ (Mailbox Thread ลองส่งใหม่ตอนว่าง)
+    uint64_t key;           // ออกให้คนแรกที่ตั้งชื่อนี้ (0 = ยังไม่มี) คนอื่นต้องใช้ NICK <ชื่อ> <key> จึงตั้งชื่อนี้ได้
+    SessionId last_session; // Session ที่ตั้งชื่อนี้ล่าสุด (DM <PID> ถึงคนที่ไม่ออนไลน์เก็บเข้าชื่อนี้)
+    time_t last_seen;       // ครั้งล่าสุดที่มี Client ตั้ง/เลิกใช้ชื่อนี้ (หรือตอนเปิดไฟล์ที่มีจดหมายค้าง)
+} MailIndexEntry;
+
 // --- Server Registry Data Structures ---
 
-// Client Registry Entry (PID -> QID + Channel + Last Active Time)
+// Client Registry Entry (Session ID -> QID + Channel + Last Active Time)
 typedef struct {
-    pid_t pid;
+    SessionId session_id;   // Key ของ Registry (0 = Slot ว่าง)
+    pid_t pid;              // Process ที่เป็นเจ้าของ Session (ใช้ตรวจ kill(pid, 0))
     int reply_qid;
+    long reply_mtype;       // 0 = Client ปกติ (Priority Lane), อื่นๆ = mtype ของ Logical Session
     char current_channel[MAX_CHANNEL]; 
-    time_t last_active; // เวลาล่าสุดที่ Client ส่งคำสั่งมา
+    char nick[NICK_MAX_LEN + 1];    // ชื่อเล่น ("" = ยังไม่ได้ตั้ง)
+    char label[MAX_USERNAME];       // ชื่อที่แสดง: nick หรือ "User <session>" (Render ตอน REGISTER/NICK)
+    char msg_prefix[MAX_USERNAME];  // sender_name ของ MSG: "[#channel] <label>" (Render ตอน REGISTER/JOIN/LEAVE/NICK)
+    _Atomic time_t last_active; // เวลาล่าสุดที่ Client ส่งคำสั่งมา (Router อัปเดตแบบ Atomic โดยไม่ต้องถือ Lock)
 } ClientEntry;
 
-// Room Registry Entry (Channel -> List of PIDs)
+// Room Registry Entry (Channel -> List of Session IDs)
 typedef struct {
     char channel_name[MAX_CHANNEL];
-    pid_t members[MAX_CLIENTS]; 
+    SessionId members[MAX_CLIENTS]; 
     int member_count;
 } RoomEntry;
 
+// Topic Trie Node: Subscriber เก็บเป็น Bitmask ของ Client Slot (MAX_CLIENTS ต้องไม่เกิน 64)
+typedef struct TopicNode {
+    char segment[MAX_CHANNEL];
+    uint64_t exact;         // Slot ที่ Subscribe Pattern ที่จบที่ Node นี้พอดี
+    uint64_t globstar;      // Slot ที่ Subscribe "<prefix>.**" (ตรงกับทุก Topic ใต้ Node นี้ รวมตัวมันเอง)
+    struct TopicNode* child;
+    struct TopicNode* sibling;
+} TopicNode;
+_Static_assert(MAX_CLIENTS <= 64, "Topic subscriber masks hold one bit per client slot");
+_Static_assert((NICK_TABLE_SIZE & (NICK_TABLE_SIZE - 1)) == 0 && NICK_TABLE_SIZE > MAX_CLIENTS,
+               "Nickname table must be a power of two with a free bucket");
+
 // Global Registry State Structure (มี Lock ป้องกัน)
 typedef struct {
     ClientEntry clients[MAX_CLIENTS];
@@ -84,6 +327,10 @@ typedef struct {
     int room_count;
 
     pthread_rwlock_t rwlock; // Reader-Writer Lock สำหรับป้องกันการเข้าถึง registries
+
+    // Seqlock สำหรับ Handler ที่อ่านอย่างเดียว (MSG/DM/WHO): Writer เพิ่มค่าภายใต้ WRITE Lock
+    // ก่อนและหลังแก้ไข (ค่าคี่ = กำลังแก้ไข) Reader แค่อ่านค่านี้จึงไม่เขียน Cache Line ที่ใช้ร่วมกัน
+    _Alignas(64) atomic_uint seq;
 } GlobalRegistry;
 
 #endif // PROJECT_DEFS_H
\ No newline at end of file
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+// ใช้โครงสร้าง GlobalRegistry และโปรโตคอล Seqlock เดียวกับ Server
+#include "project_defs.h"
+#include "registry_seqlock.h"
+
+/*
+ * registry_bench — วัดการแย่งกันอ่าน Registry ระหว่าง READ Lock (pthread_rwlock_rdlock) กับ Seqlock
+ *
+ * Usage: ./registry_bench [seconds per run] [max threads] [writer interval us]
+ *   ค่าเริ่มต้น: 1 วินาที, จำนวน CPU, Writer เปลี่ยนห้องของ Client 1 คนทุก 100 us (0 = ไม่มี Writer)
+ *
+ * Reader แต่ละ Thread ทำงานแบบเดียวกับ handle_msg/handle_dm/handle_who (หา Client, คัดลอก Channel,
+ * คัดลอกรายชื่อสมาชิกห้อง) วนไปเรื่อยๆ ส่วน Writer จำลอง JOIN ภายใต้ WRITE Lock
+ * ผ่าน seqlock_write_begin/end เดียวกับ main.c แล้วรายงานจำนวนการอ่านต่อวินาทีของแต่ละโหมดและจำนวน Thread
+ */
+
+#define BENCH_DEFAULT_SECONDS 1
+#define BENCH_DEFAULT_WRITER_US 100
+
+typedef enum { MODE_RWLOCK, MODE_SEQLOCK } BenchMode;
+
+GlobalRegistry registry;
+
+static BenchMode mode;
+static _Atomic int running = 0;
+static _Atomic int stop = 0;
+static atomic_ullong fallbacks = 0;
+
+// ตัวนับของแต่ละ Thread แยก Cache Line กัน เพื่อไม่ให้ตัวนับเองเป็นต้นเหตุของการแย่ง
+typedef struct {
+    _Alignas(64) unsigned long long reads;
+    unsigned long long checksum;
+    int id;
+} ReaderSlot;
+
+// Snapshot แบบเดียวกับที่ Handler ใช้
+typedef struct {
+    SessionId session;
+    int client_idx, room_idx;
+    char channel[MAX_CHANNEL];
+    int member_count;
+    SessionId members[MAX_CLIENTS];
+} Lookup;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int find_client_index(SessionId session) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (registry.clients[i].session_id == session) return i;
+    }
+    return -1;
+}
+
+static int find_room_index(const char* channel_name) {
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (strcmp(registry.rooms[i].channel_name, channel_name) == 0) return i;
+    }
+    return -1;
+}
+
+static void copy_lookup(void* snap) {
+    Lookup* l = snap;
+    l->client_idx = find_client_index(l->session);
+    l->room_idx = -1;
+    l->member_count = 0;
+    l->channel[0] = '\0';
+    if (l->client_idx == -1) return;
+    memcpy(l->channel, registry.clients[l->client_idx].current_channel, MAX_CHANNEL);
+    l->channel[MAX_CHANNEL - 1] = '\0';
+    l->room_idx = find_room_index(l->channel);
+    if (l->room_idx != -1) {
+        int count = registry.rooms[l->room_idx].member_count;
+        l->member_count = count < 0 ? 0 : count > MAX_CLIENTS ? MAX_CLIENTS : count;
+        memcpy(l->members, registry.rooms[l->room_idx].members, l->member_count * sizeof(SessionId));
+    }
+}
+
+static void* reader_thread(void* arg) {
+    ReaderSlot* slot = arg;
+    Lookup l;
+    unsigned long long reads = 0, checksum = 0;
+
+    atomic_fetch_add(&running, 1);
+    for (int i = 0; !atomic_load_explicit(&stop, memory_order_relaxed); i++) {
+        l.session = 1 + (slot->id + i) % MAX_CLIENTS;
+        if (mode == MODE_RWLOCK) {
+            pthread_rwlock_rdlock(&registry.rwlock);
+            copy_lookup(&l);
+            pthread_rwlock_unlock(&registry.rwlock);
+        } else {
+            seqlock_read(&registry, copy_lookup, &l, &fallbacks);
+        }
+        checksum += l.member_count + (unsigned char)l.channel[1];
+        reads++;
+    }
+    slot->reads = reads;
+    slot->checksum = checksum;
+    return NULL;
+}
+
+/**
+ * @brief ย้าย Client 1 คนไปห้องถัดไป (จำลอง JOIN ภายใต้ WRITE Lock)
+ */
+static void move_client(int client_idx) {
+    ClientEntry* c = &registry.clients[client_idx];
+    int from = find_room_index(c->current_channel);
+    int to = (from + 1) % MAX_CHANNELS;
+
+    seqlock_write_begin(&registry);
+
+    RoomEntry* old_room = &registry.rooms[from];
+    for (int i = 0; i < old_room->member_count; i++) {
+        if (old_room->members[i] == c->session_id) {
+            old_room->members[i] = old_room->members[--old_room->member_count];
+            break;
+        }
+    }
+    RoomEntry* new_room = &registry.rooms[to];
+    new_room->members[new_room->member_count++] = c->session_id;
+    strcpy(c->current_channel, new_room->channel_name);
+
+    seqlock_write_end(&registry);
+}
+
+static void* writer_thread(void* arg) {
+    long interval_us = *(long*)arg;
+    struct timespec pause = { interval_us / 1000000, (interval_us % 1000000) * 1000 };
+
+    for (int i = 0; !atomic_load_explicit(&stop, memory_order_relaxed); i++) {
+        move_client(i % MAX_CLIENTS);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+static void reset_registry() {
+    memset(&registry, 0, sizeof(GlobalRegistry));
+    pthread_rwlock_init(&registry.rwlock, NULL);
+    for (int r = 0; r < MAX_CHANNELS; r++) {
+        snprintf(registry.rooms[r].channel_name, MAX_CHANNEL, "#room%d", r);
+    }
+    registry.room_count = MAX_CHANNELS;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        RoomEntry* room = &registry.rooms[i % MAX_CHANNELS];
+        registry.clients[i].session_id = i + 1;
+        registry.clients[i].pid = i + 1;
+        strcpy(registry.clients[i].current_channel, room->channel_name);
+        room->members[room->member_count++] = i + 1;
+    }
+    registry.client_count = MAX_CLIENTS;
+}
+
+/**
+ * @brief รัน Reader จำนวน threads ตัวในโหมดที่เลือก
+ * @return จำนวนการอ่านต่อวินาทีรวมทุก Thread
+ */
+static double run(BenchMode run_mode, int threads, int seconds, long writer_us) {
+    pthread_t tids[threads], writer;
+    ReaderSlot* slots = aligned_alloc(64, sizeof(ReaderSlot) * threads);
+
+    reset_registry();
+    mode = run_mode;
+    atomic_store(&running, 0);
+    atomic_store(&stop, 0);
+    atomic_store(&fallbacks, 0);
+
+    for (int t = 0; t < threads; t++) {
+        memset(&slots[t], 0, sizeof(ReaderSlot));
+        slots[t].id = t;
+        pthread_create(&tids[t], NULL, reader_thread, &slots[t]);
+    }
+    while (atomic_load(&running) < threads) sched_yield();
+    if (writer_us > 0) pthread_create(&writer, NULL, writer_thread, &writer_us);
+
+    uint64_t start = now_ns();
+    sleep(seconds);
+    atomic_store(&stop, 1);
+    uint64_t elapsed = now_ns() - start;
+
+    unsigned long long total = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        total += slots[t].reads;
+    }
+    if (writer_us > 0) pthread_join(writer, NULL);
+    pthread_rwlock_destroy(&registry.rwlock);
+    free(slots);
+    return total / (elapsed / 1e9);
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SECONDS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long writer_us = argc > 3 ? atol(argv[3]) : BENCH_DEFAULT_WRITER_US;
+    if (seconds < 1) seconds = 1;
+    if (max_threads < 1) max_threads = 1;
+
+    printf("Registry read benchmark: %d clients, %d rooms, %ds per run, writer every %ld us%s\n",
+           MAX_CLIENTS, MAX_CHANNELS, seconds, writer_us, writer_us > 0 ? "" : " (disabled)");
+    printf("%8s %16s %16s %9s %10s\n", "threads", "rwlock reads/s", "seqlock reads/s", "speedup", "fallbacks");
+
+    for (int threads = 1; ; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2) {
+        double rw = run(MODE_RWLOCK, threads, seconds, writer_us);
+        double seq = run(MODE_SEQLOCK, threads, seconds, writer_us);
+        printf("%8d %16.0f %16.0f %8.2fx %10llu\n", threads, rw, seq, rw > 0 ? seq / rw : 0.0,
+               (unsigned long long)atomic_load(&fallbacks));
+        if (threads >= max_threads) break;
+    }
+    return 0;
+}
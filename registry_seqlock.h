@@ -0,0 +1,53 @@
+#ifndef REGISTRY_SEQLOCK_H
+#define REGISTRY_SEQLOCK_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "project_defs.h"
+
+/*
+ * โปรโตคอล Seqlock ของ Registry (ใช้ร่วมกันโดย Server และ registry_bench.c เพื่อให้วัดโค้ดชุดเดียวกัน)
+ * Writer ถือ WRITE Lock และทำให้ seq เป็นเลขคี่ตลอดช่วงที่แก้ไข ส่วน Reader คัดลอก Snapshot แล้วตรวจ seq ซ้ำ
+ */
+
+/**
+ * @brief ถือ WRITE Lock และเปิดช่วงแก้ไขของ Seqlock (seq เป็นเลขคี่)
+ */
+static inline void seqlock_write_begin(GlobalRegistry* reg) {
+    pthread_rwlock_wrlock(&reg->rwlock);
+    atomic_fetch_add_explicit(&reg->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // seq คี่ต้องมองเห็นก่อนข้อมูลที่แก้ไข
+}
+
+/**
+ * @brief ปิดช่วงแก้ไขของ Seqlock (seq กลับเป็นเลขคู่) แล้วปล่อย WRITE Lock
+ */
+static inline void seqlock_write_end(GlobalRegistry* reg) {
+    atomic_fetch_add_explicit(&reg->seq, 1, memory_order_release);
+    pthread_rwlock_unlock(&reg->rwlock);
+}
+
+/**
+ * @brief อ่าน Snapshot ของ Registry ผ่าน Seqlock
+ * @details copy() ต้องแค่คัดลอกข้อมูลลง snap (ไม่มี Side Effect) เพราะอาจถูกเรียกซ้ำหลายรอบ
+ * และอาจเห็นข้อมูลที่ขาดกลางคันในรอบที่จะถูกทิ้ง ถ้า Writer แก้ไขติดกันเกิน REGISTRY_SEQ_RETRIES รอบ
+ * จะถอยไปใช้ READ Lock เพื่อไม่ให้ Reader อดตาย
+ * @param fallbacks ตัวนับจำนวนครั้งที่ต้องถอยไปใช้ READ Lock
+ */
+static inline void seqlock_read(GlobalRegistry* reg, void (*copy)(void* snap), void* snap, atomic_ullong* fallbacks) {
+    for (int attempt = 0; attempt < REGISTRY_SEQ_RETRIES; attempt++) {
+        unsigned seq = atomic_load_explicit(&reg->seq, memory_order_acquire);
+        if (seq & 1) { sched_yield(); continue; } // Writer กำลังแก้ไข
+        copy(snap);
+        atomic_thread_fence(memory_order_acquire); // การอ่านข้อมูลต้องเสร็จก่อนตรวจ seq ซ้ำ
+        if (atomic_load_explicit(&reg->seq, memory_order_relaxed) == seq) return;
+    }
+    atomic_fetch_add_explicit(fallbacks, 1, memory_order_relaxed);
+    pthread_rwlock_rdlock(&reg->rwlock);
+    copy(snap);
+    pthread_rwlock_unlock(&reg->rwlock);
+}
+
+#endif // REGISTRY_SEQLOCK_H
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/msg.h>
+#include <sys/ipc.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+// ใช้โครงสร้างข้อความและรูปแบบไฟล์ Trace เดียวกับ Server
+#include "project_defs.h"
+// ชั้น Transport (sysv / unix) เดียวกับ client.c
+#include "client_transport.h"
+
+/*
+ * replay — เล่นไฟล์ Trace ที่ Server บันทึกไว้ (CHAT_CAPTURE) กลับเข้า Server อีกครั้ง
+ *
+ * Usage: ./replay <trace file> [speed]
+ *   speed = 1 (ค่าเริ่มต้น) เล่นตามจังหวะเวลาเดิม, N = เร็วขึ้น N เท่า, 0 = เร็วที่สุดเท่าที่ทำได้
+ *
+ * ผู้ใช้แต่ละคนใน Trace (Session ID หรือ PID เดิม) จะถูกแทนด้วย Logical Session ของ replay
+ * (MAKE_SESSION_ID(getpid(), n)) ที่ใช้ Reply Queue / Socket เดียวกัน เหมือนโหมด Gateway ของ client.c
+ * ข้อความ MSG จะถูกเติม Tag "[r<seq>] " ไว้ข้างหน้าเพื่อวัด Latency จากข้อความที่ Broadcast กลับมา
+ */
+
+#define REPLAY_MAX_IDENTITIES 512   // จำนวนผู้ใช้สูงสุดใน Trace (ต้องไม่เกิน SESSION_ID_STRIDE - 1)
+#define REPLAY_DRAIN_MS 1000        // รอข้อความที่ค้างหลังส่งคำสั่งสุดท้าย
+
+// --- GLOBAL STATE ---
+pid_t replay_pid;
+
+// Record ที่โหลดจากไฟล์ (แปลงกลับเป็น CommandMessage แล้ว)
+typedef struct {
+    uint64_t t_ns;
+    CommandMessage cmd;
+} ReplayEntry;
+
+ReplayEntry* entries = NULL;
+size_t entry_count = 0;
+
+// ตาราง Identity เดิม -> Session ของ replay (index + 1)
+long identities[REPLAY_MAX_IDENTITIES];
+int registered[REPLAY_MAX_IDENTITIES];
+int identity_count = 0;
+
+// ผลการวัด: เวลาที่ส่ง MSG แต่ละข้อความ และ Latency ของข้อความแรกที่ได้กลับมา
+int64_t* sent_ns = NULL;        // index = seq ของ MSG
+int64_t* latency_ns = NULL;     // -1 = ยังไม่ได้รับ
+size_t msg_count = 0;
+_Atomic uint64_t replies_received = 0;
+
+// --- TRANSPORT (Backend อยู่ใน client_transport.h, ทุก Session อ่านจากช่องทางเดียวกัน) ---
+const ClientTransport* transport = NULL;
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// --- Trace Loading ---
+
+/**
+ * @brief โหลดไฟล์ Trace ทั้งหมดเข้าหน่วยความจำก่อนเริ่มเล่น (ไม่ให้ Disk I/O กระทบจังหวะเวลา)
+ * @return 0 หากสำเร็จ, -1 หากไฟล์ไม่ถูกต้อง
+ */
+static int load_trace(const char* path) {
+    FILE* f = fopen(path, "rb");
+    char magic[TRACE_MAGIC_LEN];
+    size_t capacity = 1024;
+
+    if (f == NULL) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+    if (fread(magic, 1, TRACE_MAGIC_LEN, f) != TRACE_MAGIC_LEN || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    entries = malloc(capacity * sizeof(ReplayEntry));
+    TraceRecord hdr;
+    while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+        if (hdr.channel_len > MAX_CHANNEL || hdr.target_len > MAX_USERNAME ||
+            hdr.channels_len > MAX_CHANNEL_LIST || hdr.text_len > MAX_TEXT_SIZE) {
+            fprintf(stderr, "%s: corrupt record #%zu, stopping\n", path, entry_count);
+            break;
+        }
+        if (entry_count == capacity) {
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(ReplayEntry));
+        }
+        ReplayEntry* e = &entries[entry_count];
+        memset(e, 0, sizeof(*e));
+        e->t_ns = hdr.t_ns;
+        e->cmd.mtype = MSG_TYPE_COMMAND;
+        e->cmd.command = (CommandCode)hdr.command;
+        e->cmd.sender_pid = hdr.sender_pid;
+        e->cmd.reply_qid = hdr.reply_qid;
+        e->cmd.session_id = hdr.session_id;
+        // ความยาวเต็ม Buffer = ไม่มี '\0' เหมือนตอนที่ Server รับมา
+        if (fread(e->cmd.channel, 1, hdr.channel_len, f) != hdr.channel_len ||
+            fread(e->cmd.target, 1, hdr.target_len, f) != hdr.target_len ||
+            fread(e->cmd.channels, 1, hdr.channels_len, f) != hdr.channels_len ||
+            fread(e->cmd.text, 1, hdr.text_len, f) != hdr.text_len) {
+            fprintf(stderr, "%s: truncated record #%zu, stopping\n", path, entry_count);
+            break;
+        }
+        if (e->cmd.command == CMD_MSG) msg_count++;
+        entry_count++;
+    }
+    fclose(f);
+    return 0;
+}
+
+// --- Identity Mapping ---
+
+/**
+ * @brief แปลงผู้ใช้เดิมใน Trace (Session ID หรือ PID) เป็น index ของ Session ใน replay
+ * @return index (0..), หรือ -1 หากเกิน REPLAY_MAX_IDENTITIES
+ */
+static int identity_index(long original) {
+    for (int i = 0; i < identity_count; i++) {
+        if (identities[i] == original) return i;
+    }
+    if (identity_count == REPLAY_MAX_IDENTITIES) return -1;
+    identities[identity_count] = original;
+    registered[identity_count] = 0;
+    return identity_count++;
+}
+
+static long replay_session(int idx) {
+    return MAKE_SESSION_ID(replay_pid, idx + 1);
+}
+
+/**
+ * @brief ส่งคำสั่งในนามของ Session ของ replay (เขียน PID, Reply Queue และ Session ใหม่)
+ */
+static int send_as(int idx, CommandMessage* cmd) {
+    cmd->sender_pid = replay_pid;
+    cmd->reply_qid = reply_qid;
+    cmd->session_id = replay_session(idx);
+    memset(&cmd->stamps, 0, sizeof(cmd->stamps));
+    cmd->stamps.client_send_ns = now_ns();
+    int err = transport->send_command(cmd);
+    if (err != 0) fprintf(stderr, "replay: send failed: %s\n", strerror(err));
+    return err;
+}
+
+// --- RECEIVER (นับข้อความตอบกลับและจับคู่ Tag ของ MSG เพื่อคำนวณ Latency) ---
+void* receiver_thread(void* arg) {
+    ReplyMessage reply;
+    int queue_requested = 0;
+    int queue_limited = 0;      // แจ้งเตือนเรื่อง msgmnb เพียงครั้งเดียว
+
+    while (1) {
+        int err = transport->recv_reply(&reply);
+        if (err == EIDRM) break;
+        if (err != 0) continue;
+
+        int64_t t = now_ns();
+        replies_received++;
+
+        // ทุก Session ใช้ Reply Queue เดียวกัน: ขยายตามค่าที่ตกลงกันต่อ Session x จำนวน Session ที่เห็นแล้ว
+        if (reply.queue_capacity > 0 && transport->resize) {
+            int want = reply.queue_capacity * identity_count;
+            if (want > queue_requested) {
+                queue_requested = want;
+                int got = transport->resize(want);
+                if (got > 0 && got < want && !queue_limited) {
+                    queue_limited = 1;
+                    fprintf(stderr, "replay: reply queue limited to %d msgs (asked for %d; above kernel.msgmnb needs CAP_SYS_RESOURCE)\n",
+                            got, want);
+                }
+            }
+        }
+
+        unsigned long seq;
+        if (sscanf(reply.text, "[r%lu] ", &seq) == 1 && seq < msg_count &&
+            sent_ns[seq] != 0 && latency_ns[seq] < 0) {
+            latency_ns[seq] = t - sent_ns[seq];
+        }
+    }
+    return NULL;
+}
+
+static int cmp_i64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief พิมพ์สรุปผล: Throughput และ Latency Percentile ของ MSG ที่ได้รับกลับมา
+ */
+static void report(size_t sent, int64_t elapsed_ns) {
+    size_t n = 0;
+    int64_t* sorted = malloc((msg_count ? msg_count : 1) * sizeof(int64_t));
+
+    for (size_t i = 0; i < msg_count; i++) {
+        if (latency_ns[i] >= 0) sorted[n++] = latency_ns[i];
+    }
+    qsort(sorted, n, sizeof(int64_t), cmp_i64);
+
+    double secs = elapsed_ns / 1e9;
+    printf("Replay: %zu commands sent in %.3f s (%.0f cmd/s), %llu replies received.\n",
+           sent, secs, secs > 0 ? sent / secs : 0.0, (unsigned long long)replies_received);
+    printf("Replay: %d sessions, %zu/%zu MSG echoes matched.\n", identity_count, n, msg_count);
+    if (n > 0) {
+        printf("Replay: latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               sorted[n * 50 / 100] / 1e6, sorted[n * 90 / 100] / 1e6,
+               sorted[n * 99 / 100] / 1e6, sorted[n - 1] / 1e6);
+    }
+    free(sorted);
+}
+
+// --- MAIN FUNCTION ---
+int main(int argc, char* argv[]) {
+    pthread_t receiver_tid;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace file> [speed (1 = original, 0 = max)]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    double speed = argc > 2 ? atof(argv[2]) : 1.0;
+    if (speed < 0) speed = 0;
+
+    if (load_trace(argv[1]) == -1) return EXIT_FAILURE;
+    printf("Replay: Loaded %zu commands (%zu MSG) from %s\n", entry_count, msg_count, argv[1]);
+
+    sent_ns = calloc(msg_count ? msg_count : 1, sizeof(int64_t));
+    latency_ns = malloc((msg_count ? msg_count : 1) * sizeof(int64_t));
+    for (size_t i = 0; i < msg_count; i++) latency_ns[i] = -1;
+
+    replay_pid = getpid();
+    transport = transport_from_env();
+    if (transport->connect() == -1) {
+        transport->close();
+        return EXIT_FAILURE;
+    }
+    if (pthread_create(&receiver_tid, NULL, receiver_thread, NULL) != 0) {
+        perror("pthread_create (receiver)");
+        transport->close();
+        return EXIT_FAILURE;
+    }
+
+    size_t sent = 0, msg_seq = 0;
+    int64_t start = now_ns();
+    uint64_t t0 = entry_count > 0 ? entries[0].t_ns : 0;
+
+    for (size_t i = 0; i < entry_count; i++) {
+        CommandMessage cmd = entries[i].cmd;
+        long original = cmd.session_id != 0 ? cmd.session_id : cmd.sender_pid;
+        int idx = identity_index(original);
+        if (idx == -1) {
+            fprintf(stderr, "replay: more than %d users in trace, skipping record #%zu\n", REPLAY_MAX_IDENTITIES, i);
+            continue;
+        }
+
+        // รักษาจังหวะเวลาตาม Trace (หารด้วย speed), speed 0 = ไม่รอ
+        if (speed > 0) {
+            int64_t due = start + (int64_t)((entries[i].t_ns - t0) / speed);
+            struct timespec ts = { due / 1000000000LL, due % 1000000000LL };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+
+        // QUIT ของ Identity ที่ไม่ได้ลงทะเบียนอยู่: ข้ามไปเลย ไม่สร้าง REGISTER/QUIT ที่ไม่มีใน Trace
+        // (Backend unix: Server แปลงการหลุดของ Socket เป็น CMD_QUIT อีกครั้งหลัง QUIT จริง และ Trace บันทึกไว้ทั้งคู่)
+        if (!registered[idx] && cmd.command == CMD_QUIT) continue;
+
+        // ผู้ใช้ที่เชื่อมต่อก่อนเริ่ม Capture จะไม่มี REGISTER ใน Trace: ลงทะเบียนให้ก่อน
+        if (!registered[idx]) {
+            registered[idx] = 1;
+            if (cmd.command != CMD_REGISTER) {
+                CommandMessage reg;
+                memset(&reg, 0, sizeof(reg));
+                reg.mtype = MSG_TYPE_COMMAND;
+                reg.command = CMD_REGISTER;
+                strcpy(reg.text, "Replay session");
+                if (send_as(idx, &reg) == EIDRM) break;
+                sent++;
+            }
+        } else if (cmd.command == CMD_REGISTER) {
+            continue; // REGISTER ซ้ำจาก Trace (Server เดิมปฏิเสธไปแล้ว)
+        }
+
+        if (cmd.command == CMD_DM) {
+            // DM ระบุผู้รับด้วย Session ID/PID เดิม: แปลงเป็น Session ของ replay
+            // ผู้รับที่ระบุด้วยชื่อเล่น (ไม่ใช่ตัวเลขทั้งหมด) ส่งต่อไปตามเดิม เพราะ NICK ใน Trace ถูกเล่นซ้ำด้วย
+            char target[MAX_USERNAME + 1], *end;
+            memcpy(target, cmd.target, MAX_USERNAME);
+            target[MAX_USERNAME] = '\0';
+            long original_target = strtol(target, &end, 10);
+            if (end != target && *end == '\0') {
+                int t = identity_index(original_target);
+                if (t != -1) snprintf(cmd.target, MAX_USERNAME, "%ld", replay_session(t));
+            }
+        } else if (cmd.command == CMD_MSG) {
+            char text[MAX_TEXT_SIZE + 1];
+            memcpy(text, cmd.text, MAX_TEXT_SIZE);
+            text[MAX_TEXT_SIZE] = '\0';
+            snprintf(cmd.text, MAX_TEXT_SIZE, "[r%zu] %.*s", msg_seq, MAX_TEXT_SIZE - 24, text);
+            sent_ns[msg_seq++] = now_ns();
+        }
+
+        if (send_as(idx, &cmd) == EIDRM) break;
+        sent++;
+        if (cmd.command == CMD_QUIT) registered[idx] = 0;
+    }
+    int64_t elapsed = now_ns() - start;
+
+    // รอข้อความที่ยังค้างอยู่ แล้วออกจากทุก Session ที่ยังลงทะเบียนอยู่
+    usleep(REPLAY_DRAIN_MS * 1000);
+    for (int i = 0; i < identity_count; i++) {
+        if (!registered[i]) continue;
+        CommandMessage quit;
+        memset(&quit, 0, sizeof(quit));
+        quit.mtype = MSG_TYPE_COMMAND;
+        quit.command = CMD_QUIT;
+        strcpy(quit.text, "Replay finished");
+        send_as(i, &quit);
+    }
+
+    transport->close();
+    pthread_join(receiver_tid, NULL);
+    report(sent, elapsed);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef SYSV_CAPACITY_H
+#define SYSV_CAPACITY_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/msg.h>
+#include <sys/ipc.h>
+
+/*
+ * ตั้งความจุของ System V Message Queue เป็นจำนวนข้อความ (ใช้ร่วมกันโดย Server, client.c และ replay.c)
+ */
+
+/**
+ * @brief ตั้งความจุของ Message Queue (msg_qbytes) เป็นจำนวนข้อความขนาด frame_size
+ * @details การตั้งเกิน kernel.msgmnb ต้องใช้ CAP_SYS_RESOURCE หากได้ EPERM จะลดลงมาเท่า msgmnb แทน
+ * @return ความจุที่ตั้งได้จริง (ข้อความ) หรือ -1 หากล้มเหลว
+ */
+static int sysv_set_capacity(int qid, int msgs, size_t frame_size) {
+    struct msqid_ds ds;
+    if (msgctl(qid, IPC_STAT, &ds) == -1) return -1;
+
+    ds.msg_qbytes = (msglen_t)msgs * frame_size;
+    if (msgctl(qid, IPC_SET, &ds) == -1) {
+        if (errno != EPERM) return -1;
+        FILE* f = fopen("/proc/sys/kernel/msgmnb", "r");
+        unsigned long msgmnb = 0;
+        if (f == NULL || fscanf(f, "%lu", &msgmnb) != 1) {
+            if (f) fclose(f);
+            return -1;
+        }
+        fclose(f);
+        if (msgmnb < ds.msg_qbytes) ds.msg_qbytes = msgmnb;
+        if (msgctl(qid, IPC_SET, &ds) == -1) return -1;
+    }
+    return (int)(ds.msg_qbytes / frame_size);
+}
+
+#endif // SYSV_CAPACITY_H